@@ -4,7 +4,7 @@ gcc \
     -Wno-unused-function \
     -Wno-implicit-function-declaration \
     -Wall -O3 main.c \
-    -Lopencv/lib -lopencv_world341
+    -Lopencv/lib -lopencv_world341 -lpthread
 
 #    -Lopencv/bin -lopencv_ffmpeg341
 
@@ -5,28 +5,218 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "opencv2/core/core_c.h"
 #include "opencv2/core/types_c.h"
 #include "opencv2/highgui/highgui_c.h"
 #include "opencv2/imgproc/imgproc_c.h"
 #include "opencv2/imgcodecs/imgcodecs_c.h"
 
+/* binary files must not be translated on windows */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 
 /* tiles count */
 #define CONFIG_NTIL 56
 /* pixel per tile, makes 10.8mm wide at 300dpi */
 #define CONFIG_NPIX 128
+/* print resolution written in tiff outputs */
+#define CONFIG_DPI 300
+/* sub cells per side of the image descriptors, see DESC_DIM */
+#define CONFIG_NGRID 2
+/* worker threads, 0 for one per online cpu */
+#define CONFIG_NTHREAD 0
+/* memory budget of the decoded tiles, in bytes */
+#define CONFIG_TILE_CACHE (256 * 1024 * 1024)
+/* timers and counters, 0 off, 1 summary at exit, 2 json at exit */
+#define CONFIG_STATS 1
 
 
 /* distance weights, refer to compute_dist */
 static unsigned int dist_w[] = { 1, 1, 1 };
 
 
+/* images and mosaic cells are described by the y cr cb means of a */
+/* CONFIG_NGRID x CONFIG_NGRID grid of sub cells, in raster order. */
+/* in memory, descriptors are zero padded to DESC_STRIDE bytes */
+#define DESC_NCELL (CONFIG_NGRID * CONFIG_NGRID)
+#define DESC_DIM (3 * DESC_NCELL)
+#define DESC_STRIDE ((DESC_DIM <= 4) ? 4 : ((DESC_DIM + 15) & ~15))
+
+
+static unsigned int get_nthread(unsigned int n)
+{
+  long ncpu;
+
+  if (n) return n;
+  if (CONFIG_NTHREAD) return CONFIG_NTHREAD;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+  ncpu = 1;
+#endif
+  if (ncpu <= 0) return 1;
+  return (unsigned int)ncpu;
+}
+
+
+static uint64_t get_nsec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* instrumentation. timers sum the time of all the threads, so */
+/* that stages running in parallel can be compared. updates are */
+/* atomic and done once per item, a row of cells or a file */
+
+struct stats_timer
+{
+  uint64_t n;
+  uint64_t nsec;
+};
+
+struct stats_info
+{
+  struct stats_timer decode;
+  struct stats_timer reshape;
+  struct stats_timer match;
+  struct stats_timer blit;
+  struct stats_timer redraw;
+  struct stats_timer index_load;
+
+  /* nearest neighbor queries, and the distances they computed */
+  uint64_t nquery;
+  uint64_t nscan;
+
+  /* decoded tile cache */
+  uint64_t tile_hit;
+  uint64_t tile_miss;
+
+  /* bytes of the decoded files, of the index and of atlas tiles */
+  uint64_t decode_bytes;
+  uint64_t index_bytes;
+  uint64_t atlas_bytes;
+};
+
+static struct stats_info stats;
+
+static inline void stats_add(uint64_t* x, uint64_t n)
+{
+  if (CONFIG_STATS) __sync_fetch_and_add(x, n);
+}
+
+static inline uint64_t stats_start(void)
+{
+  return CONFIG_STATS ? get_nsec() : 0;
+}
+
+static inline void stats_stop(struct stats_timer* t, uint64_t start)
+{
+  if (CONFIG_STATS == 0) return ;
+  __sync_fetch_and_add(&t->n, 1);
+  __sync_fetch_and_add(&t->nsec, get_nsec() - start);
+}
+
+static void stats_print(FILE* file, unsigned int is_json)
+{
+  static const char* const names[] =
+    { "decode", "reshape", "match", "blit", "redraw", "index_load" };
+  const struct stats_timer* const timers[] =
+  {
+    &stats.decode, &stats.reshape, &stats.match,
+    &stats.blit, &stats.redraw, &stats.index_load
+  };
+  const uint64_t ntile = stats.tile_hit + stats.tile_miss;
+  unsigned int i;
+
+  if (is_json)
+  {
+    fprintf(file, "{ \"timers\": {");
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+      fprintf(file, "%s \"%s\": { \"count\": %llu, \"seconds\": %.6f }",
+	      i ? "," : "", names[i], (unsigned long long)timers[i]->n,
+	      timers[i]->nsec / 1e9);
+    }
+    fprintf(file, " }, \"nquery\": %llu, \"nscan\": %llu",
+	    (unsigned long long)stats.nquery, (unsigned long long)stats.nscan);
+    fprintf(file, ", \"tile_hit\": %llu, \"tile_miss\": %llu",
+	    (unsigned long long)stats.tile_hit,
+	    (unsigned long long)stats.tile_miss);
+    fprintf(file, ", \"decode_bytes\": %llu, \"index_bytes\": %llu",
+	    (unsigned long long)stats.decode_bytes,
+	    (unsigned long long)stats.index_bytes);
+    fprintf(file, ", \"atlas_bytes\": %llu }\n",
+	    (unsigned long long)stats.atlas_bytes);
+    return ;
+  }
+
+  fprintf(file, "[ stats ]\n");
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+  {
+    const struct stats_timer* const t = timers[i];
+    if (t->n == 0) continue ;
+    fprintf(file, "%-10s %8llu x %10.3f ms = %10.3f s\n",
+	    names[i], (unsigned long long)t->n,
+	    (t->nsec / 1e6) / t->n, t->nsec / 1e9);
+  }
+  if (stats.nquery)
+  {
+    fprintf(file, "queries    %8llu, %.1f distances each\n",
+	    (unsigned long long)stats.nquery,
+	    (double)stats.nscan / stats.nquery);
+  }
+  if (ntile)
+  {
+    fprintf(file, "tile cache %8llu hit %llu miss, %.1f%%\n",
+	    (unsigned long long)stats.tile_hit,
+	    (unsigned long long)stats.tile_miss,
+	    (100.0 * stats.tile_hit) / ntile);
+  }
+  fprintf(file, "bytes read %llu decode %llu index %llu atlas\n",
+	  (unsigned long long)stats.decode_bytes,
+	  (unsigned long long)stats.index_bytes,
+	  (unsigned long long)stats.atlas_bytes);
+}
+
+static void stats_exit(void)
+{
+  stats_print(stdout, CONFIG_STATS == 2);
+}
+
+
 static IplImage* do_open(const char* filename)
 {
+  const uint64_t t = stats_start();
+  struct stat st;
   IplImage* im;
+
   im = cvLoadImage(filename, CV_LOAD_IMAGE_COLOR);
+
+  if (CONFIG_STATS && (stat(filename, &st) == 0))
+    stats_add(&stats.decode_bytes, st.st_size);
+  stats_stop(&stats.decode, t);
+
   return im;
 }
 
@@ -67,1085 +257,5799 @@ static inline void get_pixel_ycc
   ycc[2] = p[2];
 }
 
-static IplImage* bgr_to_ycc(IplImage* im)
-{
-  CvSize ycc_size;
-  IplImage* ycc_im;
+/* area averaging resampler. each destination pixel is the mean of */
+/* the source area it covers, partially covered source pixels being */
+/* weighted by the covered fraction, so that any ratio is handled. */
+/* rows are first filtered horizontally to 8.8 fixed point, then */
+/* weighted rows are summed, with sse2 when available */
 
-  ycc_size.width = im->width;
-  ycc_size.height = im->height;
-  ycc_im = cvCreateImage(ycc_size, IPL_DEPTH_8U, 3);
-  cvCvtColor(im, ycc_im, CV_BGR2YCrCb);
+#define RESAMPLE_BITS 14
 
-  return ycc_im;
-}
+struct resample_axis
+{
+  /* for each destination pixel, the first of count source pixels */
+  /* and their weights, ntap per destination pixel, summing to */
+  /* 1 << RESAMPLE_BITS */
+  unsigned int n;
+  unsigned int ntap;
+  unsigned int* first;
+  unsigned int* count;
+  uint16_t* w;
+};
 
-static IplImage* do_bin(IplImage* im, int s)
+struct resampler
 {
-  /* image pixel binning */
-  /* s the scaling factor */
+  struct resample_axis x;
+  struct resample_axis y;
+};
 
-  const int ss = s * s;
+static void resample_axis_init
+(struct resample_axis* ra, unsigned int sn, unsigned int dn)
+{
+  /* destination pixel i covers [i * sn, (i + 1) * sn) and source */
+  /* pixel k covers [k * dn, (k + 1) * dn), in 1 / dn source pixels */
 
-  IplImage* bin_im = NULL;
-  CvSize bin_size;
-  int x;
-  int y;
-  int i;
-  int j;
-  unsigned int sum[3];
-  unsigned char rgb[3];
+  const uint64_t one = 1 << RESAMPLE_BITS;
+  unsigned int i;
 
-  bin_size.width = im->width / s - ((im->width % s) ? 1 : 0);
-  bin_size.height = im->height / s - ((im->height % s) ? 1 : 0);
-  bin_im = cvCreateImage(bin_size, IPL_DEPTH_8U, 3);
+  ra->n = dn;
+  ra->ntap = (sn + dn - 1) / dn + 1;
+  ra->first = malloc(dn * sizeof(unsigned int));
+  ra->count = malloc(dn * sizeof(unsigned int));
+  ra->w = malloc(dn * ra->ntap * sizeof(uint16_t));
 
-  for (y = 0; y < bin_size.height; ++y)
+  for (i = 0; i < dn; ++i)
   {
-    for (x = 0; x < bin_size.width; ++x)
-    {
-      sum[0] = 0;
-      sum[1] = 0;
-      sum[2] = 0;
-
-      for (i = 0; i < s; ++i)
-	for (j = 0; j < s; ++j)
-	{
-	  get_pixel(im, x * s, y * s, rgb);
-
-	  sum[0] += rgb[0];
-	  sum[1] += rgb[1];
-	  sum[2] += rgb[2];
-	}
+    const uint64_t lo = (uint64_t)i * sn;
+    const uint64_t hi = (uint64_t)(i + 1) * sn;
+    uint16_t* const w = ra->w + i * ra->ntap;
+    uint64_t sum = 0;
+    unsigned int largest = 0;
+    unsigned int k;
 
-      rgb[0] = sum[0] / ss;
-      rgb[1] = sum[1] / ss;
-      rgb[2] = sum[2] / ss;
+    ra->first[i] = (unsigned int)(lo / dn);
+    ra->count[i] = (unsigned int)((hi - 1) / dn) - ra->first[i] + 1;
 
-      set_pixel(bin_im, x, y, rgb);
+    for (k = 0; k < ra->count[i]; ++k)
+    {
+      const uint64_t klo = (uint64_t)(ra->first[i] + k) * dn;
+      const uint64_t khi = klo + dn;
+      const uint64_t a = (klo > lo) ? klo : lo;
+      const uint64_t b = (khi < hi) ? khi : hi;
+      w[k] = (uint16_t)(((b - a) * one) / sn);
+      sum += w[k];
+      if (w[k] > w[largest]) largest = k;
     }
+
+    /* rounding leftover */
+    w[largest] += (uint16_t)(one - sum);
   }
+}
 
-  return bin_im;
+static void resample_axis_fini(struct resample_axis* ra)
+{
+  free(ra->first);
+  free(ra->count);
+  free(ra->w);
 }
 
+static void resampler_init
+(struct resampler* rs, int sw, int sh, int dw, int dh)
+{
+  /* from the top left sw x sh pixels of a source to dw x dh */
+  resample_axis_init(&rs->x, sw, dw);
+  resample_axis_init(&rs->y, sh, dh);
+}
 
-static IplImage* do_scale(IplImage* im, int s)
+static void resampler_fini(struct resampler* rs)
 {
-  /* image pixel binning */
-  /* s the scaling factor */
+  resample_axis_fini(&rs->x);
+  resample_axis_fini(&rs->y);
+}
 
-  IplImage* scale_im = NULL;
-  CvSize scale_size;
-  int x;
-  int y;
-  int i;
-  int j;
-  unsigned char rgb[3];
+static void resample_row
+(
+ const struct resample_axis* ra,
+ const unsigned char* src,
+ uint16_t* dst,
+ int x0,
+ int x1
+)
+{
+  /* horizontal pass of the destination columns x0 to x1 - 1 */
 
-  scale_size.width = im->width * s;
-  scale_size.height = im->height * s;
-  scale_im = cvCreateImage(scale_size, IPL_DEPTH_8U, 3);
+  int x;
+  unsigned int k;
 
-  for (y = 0; y < im->height; ++y)
+  for (x = x0; x < x1; ++x, dst += 3)
   {
-    for (x = 0; x < im->width; ++x)
+    const unsigned char* p = src + ra->first[x] * 3;
+    const uint16_t* const w = ra->w + x * ra->ntap;
+    uint32_t sum[3] = { 0, 0, 0 };
+
+    for (k = 0; k < ra->count[x]; ++k, p += 3)
     {
-      get_pixel(im, x, y, rgb);
+      sum[0] += w[k] * p[0];
+      sum[1] += w[k] * p[1];
+      sum[2] += w[k] * p[2];
+    }
+
+    /* to 8.8 fixed point */
+    dst[0] = (uint16_t)((sum[0] + (1 << 5)) >> (RESAMPLE_BITS - 8));
+    dst[1] = (uint16_t)((sum[1] + (1 << 5)) >> (RESAMPLE_BITS - 8));
+    dst[2] = (uint16_t)((sum[2] + (1 << 5)) >> (RESAMPLE_BITS - 8));
+  }
+}
+
+static void resample_col
+(
+ uint16_t* const* rows,
+ const uint16_t* w,
+ unsigned int count,
+ uint32_t* acc,
+ unsigned char* dst,
+ unsigned int n
+)
+{
+  /* vertical pass, dst the weighted sum of count rows of n values */
+
+  const uint32_t half = 1 << (RESAMPLE_BITS + 8 - 1);
+  unsigned int i = 0;
+  unsigned int k;
+
+#ifdef __SSE2__
+  const __m128i vhalf = _mm_set1_epi32((int)half);
+  const __m128i zero = _mm_setzero_si128();
 
-      for (i = 0; i < s; ++i)
-	for (j = 0; j < s; ++j)
-	  set_pixel(scale_im, x * s + i, y * s + j, rgb);
+  for (; (i + 8) <= n; i += 8)
+  {
+    __m128i acc_lo = vhalf;
+    __m128i acc_hi = vhalf;
+    __m128i res;
+
+    for (k = 0; k < count; ++k)
+    {
+      const __m128i wk = _mm_set1_epi16((short)w[k]);
+      const __m128i v = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      const __m128i plo = _mm_mullo_epi16(v, wk);
+      const __m128i phi = _mm_mulhi_epu16(v, wk);
+      acc_lo = _mm_add_epi32(acc_lo, _mm_unpacklo_epi16(plo, phi));
+      acc_hi = _mm_add_epi32(acc_hi, _mm_unpackhi_epi16(plo, phi));
     }
+
+    acc_lo = _mm_srli_epi32(acc_lo, RESAMPLE_BITS + 8);
+    acc_hi = _mm_srli_epi32(acc_hi, RESAMPLE_BITS + 8);
+    res = _mm_packs_epi32(acc_lo, acc_hi);
+    res = _mm_packus_epi16(res, zero);
+    _mm_storel_epi64((__m128i*)(dst + i), res);
   }
+#endif /* __SSE2__ */
 
-  return scale_im;
-}
+  if (i == n) return ;
 
+  for (k = 0; k < n; ++k) acc[k] = half;
 
-static void do_reshape(IplImage* im, IplImage* im_shap)
+  for (k = 0; k < count; ++k)
+  {
+    const uint16_t* const row = rows[k];
+    unsigned int j;
+    for (j = i; j < n; ++j) acc[j] += w[k] * row[j];
+  }
+
+  for (; i < n; ++i) dst[i] = (unsigned char)(acc[i] >> (RESAMPLE_BITS + 8));
+}
+
+static void resampler_run_data
+(
+ const struct resampler* rs,
+ const unsigned char* src_data,
+ int src_step,
+ unsigned char* dst_data,
+ int dst_step,
+ int x0,
+ int y0,
+ int x1,
+ int y1
+)
 {
-  int ws;
-  int hs;
-  int ss;
-  int x;
+  /* the destination rectangle x0, y0 to x1 - 1, y1 - 1 of the bgr */
+  /* pixels dst_data. filtered source rows are kept in a ring of */
+  /* rs->y.ntap rows, enough for a destination row since row taps */
+  /* are increasing */
+
+  const unsigned int n = (x1 - x0) * 3;
+  const unsigned int nring = rs->y.ntap;
+  uint16_t** ring;
+  uint16_t** rows;
+  uint32_t* acc;
+  unsigned int next_row;
+  unsigned int i;
   int y;
-  int i;
-  int j;
-  unsigned int sum[3];
-  unsigned char rgb[3];
 
-  if (im->width < im_shap->width) return ;
-  if (im->height < im_shap->height) return ;
+  if ((x0 >= x1) || (y0 >= y1)) return ;
 
-  ws = im->width / im_shap->width;
-  hs = im->height / im_shap->height;
-  ss = ws * hs;
+  ring = malloc(nring * sizeof(uint16_t*));
+  rows = malloc(nring * sizeof(uint16_t*));
+  for (i = 0; i < nring; ++i) ring[i] = malloc(n * sizeof(uint16_t));
+  acc = malloc(n * sizeof(uint32_t));
 
-  for (y = 0; y < im_shap->height; ++y)
-    for (x = 0; x < im_shap->width; ++x)
+  next_row = rs->y.first[y0];
+
+  for (y = y0; y < y1; ++y)
+  {
+    const unsigned int first = rs->y.first[y];
+    const unsigned int count = rs->y.count[y];
+    unsigned char* const dst = dst_data + y * dst_step + x0 * 3;
+
+    for (; next_row < (first + count); ++next_row)
     {
-      sum[0] = 0;
-      sum[1] = 0;
-      sum[2] = 0;
+      const unsigned char* const src = src_data + next_row * src_step;
+      resample_row(&rs->x, src, ring[next_row % nring], x0, x1);
+    }
 
-      for (i = 0; i < ws; ++i)
-	for (j = 0; j < hs; ++j)
-	{
-	  get_pixel(im, x * ws, y * hs, rgb);
+    for (i = 0; i < count; ++i) rows[i] = ring[(first + i) % nring];
 
-	  sum[0] += rgb[0];
-	  sum[1] += rgb[1];
-	  sum[2] += rgb[2];
-	}
+    resample_col(rows, rs->y.w + y * nring, count, acc, dst, n);
+  }
 
-      rgb[0] = sum[0] / ss;
-      rgb[1] = sum[1] / ss;
-      rgb[2] = sum[2] / ss;
+  for (i = 0; i < nring; ++i) free(ring[i]);
+  free(ring);
+  free(rows);
+  free(acc);
+}
 
-      set_pixel(im_shap, x, y, rgb);
-    }
+static void resampler_run
+(
+ const struct resampler* rs,
+ const IplImage* im,
+ IplImage* res_im,
+ int x0,
+ int y0,
+ int x1,
+ int y1
+)
+{
+  resampler_run_data
+    (rs, (const unsigned char*)im->imageData, im->widthStep,
+     (unsigned char*)res_im->imageData, res_im->widthStep, x0, y0, x1, y1);
 }
 
+static void do_resample(const IplImage* im, IplImage* res_im)
+{
+  /* the whole im to the whole res_im */
 
-static void do_show(IplImage* im)
+  struct resampler rs;
+
+  resampler_init(&rs, im->width, im->height, res_im->width, res_im->height);
+  resampler_run(&rs, im, res_im, 0, 0, res_im->width, res_im->height);
+  resampler_fini(&rs);
+}
+
+static IplImage* do_scale(IplImage* im, int s)
 {
-  static const char* const wname = "fu";
-  cvNamedWindow(wname, CV_WINDOW_AUTOSIZE);
-  cvShowImage(wname, im);
-  cvWaitKey(0);
+  /* image pixel replication */
+  /* s the scaling factor */
+
+  IplImage* scale_im = NULL;
+  CvSize scale_size;
+
+  scale_size.width = im->width * s;
+  scale_size.height = im->height * s;
+  scale_im = cvCreateImage(scale_size, IPL_DEPTH_8U, 3);
+
+  /* integer ratios cover a single source pixel */
+  do_resample(im, scale_im);
+
+  return scale_im;
 }
 
 
-/* build an image directory index */
+static inline uint32_t read_le32(const unsigned char* p)
+{
+  return
+    (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-static void average_rgb(const char* filename, unsigned char* rgb)
+static unsigned int is_bmp_header(const unsigned char* h, uint64_t size)
 {
-  IplImage* im;
-  int x;
-  int y;
-  uint64_t sum[3];
+  /* a text file may start with BM. the file size field must fit */
+  /* the file, and the dib header have a known size */
 
-  im = do_open(filename);
+  const uint32_t file_size = read_le32(h + 2);
+  const uint32_t dib_size = read_le32(h + 14);
 
-  sum[0] = 0;
-  sum[1] = 0;
-  sum[2] = 0;
+  if ((file_size < (14 + 12)) || (file_size > size)) return 0;
 
-  for (y = 0; y < im->height; ++y)
-    for (x = 0; x < im->width; ++x)
-    {
-      get_pixel(im, x, y, rgb);
-      sum[0] += rgb[0];
-      sum[1] += rgb[1];
-      sum[2] += rgb[2];
-    }
+  switch (dib_size)
+  {
+  case 12: case 40: case 108: case 124: break ;
+  default: return 0;
+  }
 
-  rgb[0] = sum[0] / (im->width * im->height);
-  rgb[1] = sum[1] / (im->width * im->height);
-  rgb[2] = sum[2] / (im->width * im->height);
+  return (14 + dib_size) <= file_size;
+}
 
-  cvReleaseImage(&im);
+static inline unsigned int is_pnm_space(unsigned char c)
+{
+  return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r');
 }
 
-static void average_ycc(const char* filename, unsigned char* ycc)
+static unsigned int is_pnm_header(const unsigned char* h, size_t n)
 {
-  IplImage* im;
-  IplImage* ycc_im;
-  int x;
-  int y;
-  uint64_t sum[3];
+  /* P1 to P6, whitespace, then the width or a comment */
 
-  im = do_open(filename);
-  ycc_im = bgr_to_ycc(im);
-  cvReleaseImage(&im);
+  size_t i;
 
-  sum[0] = 0;
-  sum[1] = 0;
-  sum[2] = 0;
+  if ((h[0] != 'P') || (h[1] < '1') || (h[1] > '6')) return 0;
+  if (is_pnm_space(h[2]) == 0) return 0;
 
-  for (y = 0; y < ycc_im->height; ++y)
-    for (x = 0; x < ycc_im->width; ++x)
-    {
-      get_pixel(ycc_im, x, y, ycc);
+  for (i = 3; (i < n) && is_pnm_space(h[i]); ++i) ;
+  if (i == n) return 1;
+  return (h[i] == '#') || ((h[i] >= '0') && (h[i] <= '9'));
+}
 
-      /* actually ccy */
-      sum[0] += ycc[2];
-      sum[1] += ycc[1];
-      sum[2] += ycc[0];
-    }
+static unsigned int is_image_file(const char* filename)
+{
+  /* format signature check, without decoding. jpeg, png, gif, */
+  /* bmp, tiff, pnm and webp */
+
+  unsigned char h[18];
+  struct stat st;
+  ssize_t n;
+  int fd;
+
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd == -1) return 0;
+  if (fstat(fd, &st))
+  {
+    close(fd);
+    return 0;
+  }
+  n = read(fd, h, sizeof(h));
+  close(fd);
 
-  ycc[0] = sum[0] / (ycc_im->width * ycc_im->height);
-  ycc[1] = sum[1] / (ycc_im->width * ycc_im->height);
-  ycc[2] = sum[2] / (ycc_im->width * ycc_im->height);
+  if (n < 4) return 0;
 
-  cvReleaseImage(&ycc_im);
+  if ((h[0] == 0xff) && (h[1] == 0xd8) && (h[2] == 0xff)) return 1;
+  if ((h[0] == 0x89) && (memcmp(h + 1, "PNG", 3) == 0)) return 1;
+  if (memcmp(h, "GIF8", 4) == 0) return 1;
+  if ((n == 18) && (h[0] == 'B') && (h[1] == 'M'))
+    return is_bmp_header(h, (uint64_t)st.st_size);
+  if (memcmp(h, "II*\0", 4) == 0) return 1;
+  if (memcmp(h, "MM\0*", 4) == 0) return 1;
+  if (is_pnm_header(h, (size_t)n)) return 1;
+  if ((n >= 12) && (memcmp(h, "RIFF", 4) == 0) &&
+      (memcmp(h + 8, "WEBP", 4) == 0))
+    return 1;
+
+  return 0;
 }
 
-static void do_index(const char* dirname)
+
+static inline unsigned int is_abs_path(const char* path)
 {
-  /* foreach jpg in dirname, compute channel average */
+#ifdef _WIN32
+  if (path[0] && (path[1] == ':')) return 1;
+#endif
+  return path[0] == '/';
+}
 
-  char filename[256];
-  DIR* dirp;
-  struct dirent* dent;
-  unsigned char rgb[3];
-  unsigned char ycc[3];
-  int line_len;
-  int index_fd;
-  char line_buf[256];
 
-  dirp = opendir(dirname);
-  if (dirp == NULL) return ;
+static int dir_path
+(char* buf, size_t size, const char* dirname, const char* name)
+{
+  /* dirname/name, -1 if it does not fit in size bytes */
+
+  const int n = snprintf(buf, size, "%s/%s", dirname, name);
+  return ((n < 0) || ((size_t)n >= size)) ? -1 : 0;
+}
 
-  sprintf(filename, "%s/%s", dirname, "tilit_index");
-  index_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
 
-  dent = readdir(dirp);
-  while (dent != NULL)
-  {
-    if (strcmp(dent->d_name, "tilit_index") == 0) goto skip_index;
-    if (strcmp(dent->d_name, "wget.sh") == 0) goto skip_index;
-    if (strcmp(dent->d_name, "wget.py") == 0) goto skip_index;
-    if (strcmp(dent->d_name, ".") == 0) goto skip_index;
-    if (strcmp(dent->d_name, "..") == 0) goto skip_index;
+static int entry_path
+(char* buf, size_t size, const char* dirname, const char* name)
+{
+  /* entry names are relative to the index directory, or absolute */
+  /* for the files of other roots. -1 if the path does not fit */
 
-    sprintf(filename, "%s/%s", dirname, dent->d_name);
+  int n;
 
-    average_rgb(filename, rgb);
-    average_ycc(filename, ycc);
+  if (is_abs_path(name) == 0) return dir_path(buf, size, dirname, name);
 
-    line_len = sprintf
-    (
-     line_buf, "%s %02x %02x %02x %02x %02x %02x\n",
-     dent->d_name,
-     rgb[0], rgb[1], rgb[2],
-     ycc[0], ycc[1], ycc[2]
-    );
+  n = snprintf(buf, size, "%s", name);
+  return ((n < 0) || ((size_t)n >= size)) ? -1 : 0;
+}
 
-    write(index_fd, line_buf, line_len);
 
-  skip_index:
-    dent = readdir(dirp);
-  }
+static void do_reshape(IplImage* im, IplImage* im_shap)
+{
+  const uint64_t t = stats_start();
+  do_resample(im, im_shap);
+  stats_stop(&stats.reshape, t);
+}
 
-  close(index_fd);
 
-  closedir(dirp);
+static void do_show(IplImage* im)
+{
+  static const char* const wname = "fu";
+  cvNamedWindow(wname, CV_WINDOW_AUTOSIZE);
+  cvShowImage(wname, im);
+  cvWaitKey(0);
 }
 
 
-/* index */
+/* binary index file. a header, fixed width records sorted by name */
+/* then the string table holding the nul terminated names. fields */
+/* are in host byte order, the file is mapped as is at load time */
+
+#define INDEX_MAGIC "TLIX"
+#define INDEX_VERSION 2
+
+/* entry identifiers are record positions in the index file */
+#define INDEX_NONE ((unsigned int)-1)
 
-struct index_entry
+struct index_header
 {
-  char filename[128];
-  unsigned char rgb[3];
-  unsigned char ycc[3];
-  unsigned int penalty;
-  IplImage* cached_im;
-  struct index_entry* next;
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t rec_size;
+  uint64_t strtab_off;
+  uint64_t strtab_size;
+  /* CONFIG_NGRID the index was built with */
+  uint32_t ngrid;
+  /* identifies the build, shared with the matching atlas */
+  uint32_t stamp;
 };
 
-struct index_info
+struct index_record
 {
-  struct index_entry* ie;
-  char dirname[128];
+  /* offset of the name in the string table */
+  uint32_t name_off;
+  uint8_t rgb[3];
+  uint8_t ycc[3];
+  uint8_t pad[2];
+  /* file metadata, to detect changes */
+  uint64_t size;
+  uint64_t mtime;
+  /* sub cells descriptor */
+  uint8_t desc[(DESC_DIM + 7) & ~7];
 };
 
-static const char* read_line(int fd)
+struct index_map
 {
-  static char line_buf[128];
-  unsigned int i;
-  for (i = 0; i < sizeof(line_buf) - 1; ++i)
-  {
-    if (read(fd, line_buf + i, 1) != 1) return NULL;
-    if (line_buf[i] == '\n') break ;
-  }
-  line_buf[i] = 0;
-  return line_buf;
-}
+  void* addr;
+  size_t size;
+  const struct index_header* h;
+  const struct index_record* recs;
+  const char* strtab;
+};
 
-static void index_load(struct index_info* ii, const char* dirname)
+static void* map_file(const char* filename, size_t* size)
 {
-  char filename[128];
-  const char* line;
-  struct index_entry* ie;
-  struct index_entry* prev_ie = NULL;
   int fd;
-  unsigned int rgb[3];
-  unsigned int ycc[3];
+  struct stat st;
+  void* addr;
 
-  strcpy(ii->dirname, dirname);
-  ii->ie = NULL;
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd == -1) return NULL;
 
-  sprintf(filename, "%s/tilit_index", dirname);
-
-  fd = open(filename, O_RDONLY);
-
-  while ((line = read_line(fd)) != NULL)
+  if (fstat(fd, &st) || (st.st_size == 0))
   {
-    ie = malloc(sizeof(struct index_entry));
-    ie->next = NULL;
-    ie->penalty = 0;
-    ie->cached_im = NULL;
-
-    sscanf
-    (
-     line, "%s %02x %02x %02x %02x %02x %02x",
-     ie->filename,
-     &rgb[0], &rgb[1], &rgb[2],
-     &ycc[0], &ycc[1], &ycc[2]
-    );
-
-    ie->rgb[0] = (unsigned char)rgb[0];
-    ie->rgb[1] = (unsigned char)rgb[1];
-    ie->rgb[2] = (unsigned char)rgb[2];
+    close(fd);
+    return NULL;
+  }
 
-    ie->ycc[0] = (unsigned char)ycc[0];
-    ie->ycc[1] = (unsigned char)ycc[1];
-    ie->ycc[2] = (unsigned char)ycc[2];
+  *size = (size_t)st.st_size;
 
-    if (prev_ie != NULL) prev_ie->next = ie;
-    else ii->ie = ie;
-    prev_ie = ie;
+#ifdef _WIN32
+  /* no mmap, read the whole file */
+  addr = malloc(*size);
+  if ((addr != NULL) && (read(fd, addr, *size) != (ssize_t)*size))
+  {
+    free(addr);
+    addr = NULL;
   }
+#else
+  addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) addr = NULL;
+#endif
 
   close(fd);
+
+  return addr;
 }
 
-static void index_free(struct index_info* ii)
+static void unmap_file(void* addr, size_t size)
 {
-  struct index_entry* ie = ii->ie;
-
-  while (ie)
-  {
-    struct index_entry* const tmp = ie;
-    ie = ie->next;
-    if (tmp->cached_im != NULL) cvReleaseImage(&tmp->cached_im);
-    free(tmp);
-  }
+#ifdef _WIN32
+  free(addr);
+#else
+  munmap(addr, size);
+#endif
 }
 
-static unsigned int compute_dist
-(const unsigned char* a, const unsigned char* b)
+static int index_map_open(struct index_map* map, const char* filename)
 {
-  unsigned int d = 0;
+  const struct index_header* h;
   unsigned int i;
 
-  for (i = 0; i < 3; ++i)
-  {
-    const int diff = (a[i] - b[i]) / dist_w[i];
-    d += diff * diff;
-  }
+  map->addr = map_file(filename, &map->size);
+  if (map->addr == NULL) return -1;
+
+  h = map->addr;
+  if (map->size < sizeof(struct index_header)) goto on_error;
+  if (memcmp(h->magic, INDEX_MAGIC, 4)) goto on_error;
+  if (h->version != INDEX_VERSION) goto on_error;
+  if (h->rec_size != sizeof(struct index_record)) goto on_error;
+  if (h->ngrid != CONFIG_NGRID) goto on_error;
+  if ((sizeof(struct index_header) + (uint64_t)h->count * h->rec_size) >
+      h->strtab_off) goto on_error;
+  if (h->strtab_off > map->size) goto on_error;
+  if (h->strtab_size > (map->size - h->strtab_off)) goto on_error;
+  if ((h->strtab_size == 0) && h->count) goto on_error;
+
+  map->h = h;
+  map->recs = (const struct index_record*)(h + 1);
+  map->strtab = (const char*)map->addr + h->strtab_off;
+
+  /* names must be terminated inside the table */
+  if (h->count && map->strtab[h->strtab_size - 1]) goto on_error;
+  for (i = 0; i < h->count; ++i)
+    if (map->recs[i].name_off >= h->strtab_size) goto on_error;
 
-  return d;
+  return 0;
+
+ on_error:
+  unmap_file(map->addr, map->size);
+  return -1;
 }
 
-static struct index_entry* index_find
-(
- struct index_info* ii,
- const unsigned char* rgb,
- const unsigned char* ycc
-)
+static void index_map_close(struct index_map* map)
 {
-  struct index_entry* ie = ii->ie;
-  unsigned int best_dist;
-  struct index_entry* best_ie;
+  unmap_file(map->addr, map->size);
+}
 
-  best_dist = compute_dist(ycc, ie->ycc);
-  best_ie = ie;
-  ie = ie->next;
 
-  while (ie)
-  {
-    if (ie->penalty && (--ie->penalty)) goto skip_ie;
+/* thumbnail atlas file. a header then, for each index record and */
+/* in the same order, the CONFIG_NPIX x CONFIG_NPIX tile as packed */
+/* bgr rows. rendering copies tiles from the mapped file */
 
-    const unsigned int this_dist = compute_dist(ycc, ie->ycc);
+#define ATLAS_MAGIC "TLAT"
+#define ATLAS_VERSION 2
+#define ATLAS_TILE_SIZE (CONFIG_NPIX * CONFIG_NPIX * 3)
 
-    if (this_dist < best_dist)
-    {
-      best_dist = this_dist;
-      best_ie = ie;
-    }
+struct atlas_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t npix;
+  /* stamp of the index built along */
+  uint32_t stamp;
+  uint32_t pad;
+  uint64_t data_off;
+};
 
-  skip_ie:
-    ie = ie->next;
-  }
+struct atlas_map
+{
+  void* addr;
+  size_t size;
+  const unsigned char* data;
+};
+
+static int atlas_map_open
+(struct atlas_map* map, const char* filename, const struct index_header* ih)
+{
+  const struct atlas_header* h;
+
+  map->addr = map_file(filename, &map->size);
+  if (map->addr == NULL) return -1;
+
+  h = map->addr;
+  if (map->size < sizeof(struct atlas_header)) goto on_error;
+  if (memcmp(h->magic, ATLAS_MAGIC, 4)) goto on_error;
+  if (h->version != ATLAS_VERSION) goto on_error;
+  if (h->npix != CONFIG_NPIX) goto on_error;
+  if ((h->count != ih->count) || (h->stamp != ih->stamp)) goto on_error;
+  if (h->data_off > map->size) goto on_error;
+  if (((uint64_t)h->count * ATLAS_TILE_SIZE) > (map->size - h->data_off))
+    goto on_error;
 
-  /* tile can appear 1.5 lines later */
-  best_ie->penalty = (3 * CONFIG_NTIL) / 2;
+  map->data = (const unsigned char*)map->addr + h->data_off;
 
-  return best_ie;
+  return 0;
+
+ on_error:
+  unmap_file(map->addr, map->size);
+  return -1;
+}
+
+static void atlas_map_close(struct atlas_map* map)
+{
+  unmap_file(map->addr, map->size);
 }
 
 
-/* tiler */
+/* build an image directory index */
 
-struct mozaic_info
+/* CV_BGR2YCrCb fixed point coefficients, as used by cvCvtColor */
+#define YCC_SHIFT 14
+#define YCC_R2Y 4899
+#define YCC_G2Y 9617
+#define YCC_B2Y 1868
+#define YCC_CR 11682
+#define YCC_CB 9241
+#define YCC_DELTA (128 << YCC_SHIFT)
+#define YCC_DESCALE(__x) (((__x) + (1 << (YCC_SHIFT - 1))) >> YCC_SHIFT)
+
+static inline unsigned char saturate_u8(int x)
 {
-  struct index_entry** tile_arr;
-  int h;
-  int w;
-  IplImage* tile_im;
-  IplImage* ycc_im;
-};
+  if (x < 0) return 0;
+  if (x > 255) return 255;
+  return (unsigned char)x;
+}
+
+static inline void bgr_to_ycc_pixel
+(const unsigned char* bgr, unsigned char* ycc)
+{
+  /* ycc[0] the luma, ycc[1] the red and ycc[2] the blue chroma */
+
+  const int y = YCC_DESCALE
+    (bgr[0] * YCC_B2Y + bgr[1] * YCC_G2Y + bgr[2] * YCC_R2Y);
 
-static void do_tile
+  ycc[0] = saturate_u8(y);
+  ycc[1] = saturate_u8(YCC_DESCALE((bgr[2] - y) * YCC_CR + YCC_DELTA));
+  ycc[2] = saturate_u8(YCC_DESCALE((bgr[0] - y) * YCC_CB + YCC_DELTA));
+}
+
+static void average_image
 (
- const char* im_filename,
- struct index_info* ii,
- struct mozaic_info* mi
+ IplImage* im,
+ unsigned char* rgb,
+ unsigned char* ycc,
+ unsigned char* desc
 )
 {
-  int s;
-  IplImage* im_ini;
-  IplImage* im_bin;
+  /* compute all the channel averages of a decoded image in a */
+  /* single sweep over the pixels, without intermediate image */
+
   int x;
   int y;
-  unsigned char rgb[3];
-  unsigned char ycc[3];
+  int g;
+  int k;
+  int bounds[CONFIG_NGRID + 1];
+  uint64_t rgb_sum[3];
+  uint64_t ycc_sum[3];
+  uint64_t cell_sum[DESC_DIM];
+  uint64_t cell_npix[DESC_NCELL];
+  uint64_t npix;
+
+  memset(rgb_sum, 0, sizeof(rgb_sum));
+  memset(ycc_sum, 0, sizeof(ycc_sum));
+  memset(cell_sum, 0, sizeof(cell_sum));
+  memset(cell_npix, 0, sizeof(cell_npix));
+
+  /* sub cell g spans columns [bounds[g], bounds[g + 1]) */
+  for (g = 0; g <= CONFIG_NGRID; ++g)
+    bounds[g] = (g * im->width + CONFIG_NGRID - 1) / CONFIG_NGRID;
 
-  im_ini = do_open(im_filename);
+  for (y = 0; y < im->height; ++y)
+  {
+    const unsigned char* p = (const unsigned char*)
+      (im->imageData + y * im->widthStep);
+    const int gy = (y * CONFIG_NGRID) / im->height;
 
-  /* tile count */
-  const int ntil = CONFIG_NTIL;
-  const int largest =
-    im_ini->width > im_ini->height ? im_ini->width : im_ini->height;
-  s = largest / ntil;
-  im_bin = do_bin(im_ini, s);
+    for (g = 0; g < CONFIG_NGRID; ++g)
+    {
+      const int cell = gy * CONFIG_NGRID + g;
 
-  /* turn into ycc */
-  mi->ycc_im = bgr_to_ycc(im_bin);
+      /* per row sums fit in 32 bits */
+      uint32_t row_rgb[3] = { 0, 0, 0 };
+      uint32_t row_ycc[3] = { 0, 0, 0 };
 
-  /* prepare resulting array */
-  mi->w = mi->ycc_im->width;
-  mi->h = mi->ycc_im->height;
-  mi->tile_arr = malloc(mi->w * mi->h * sizeof(struct index_entry*));
+      for (x = bounds[g]; x < bounds[g + 1]; ++x, p += 3)
+      {
+	unsigned char pix_ycc[3];
 
-  printf("[ do_tile ]\n");
+	bgr_to_ycc_pixel(p, pix_ycc);
 
-  for (y = 0; y < mi->h; ++y)
-  {
-    printf("y == %d\n", y); fflush(stdout);
+	row_rgb[0] += p[2];
+	row_rgb[1] += p[1];
+	row_rgb[2] += p[0];
 
-    for (x = 0; x < mi->w; ++x)
-    {
-      get_pixel_rgb(im_bin, x, y, rgb);
-      get_pixel_ycc(mi->ycc_im, x, y, ycc);
+	row_ycc[0] += pix_ycc[0];
+	row_ycc[1] += pix_ycc[1];
+	row_ycc[2] += pix_ycc[2];
+      }
 
-      /* find nearest indexed image */
-      mi->tile_arr[y * mi->w + x] = index_find(ii, rgb, ycc);
+      rgb_sum[0] += row_rgb[0];
+      rgb_sum[1] += row_rgb[1];
+      rgb_sum[2] += row_rgb[2];
+
+      for (k = 0; k < 3; ++k)
+      {
+	ycc_sum[k] += row_ycc[k];
+	cell_sum[cell * 3 + k] += row_ycc[k];
+      }
+
+      cell_npix[cell] += bounds[g + 1] - bounds[g];
     }
   }
 
-  cvReleaseImage(&im_bin);
-  cvReleaseImage(&im_ini);
-}
+  npix = (uint64_t)im->width * (uint64_t)im->height;
 
+  rgb[0] = rgb_sum[0] / npix;
+  rgb[1] = rgb_sum[1] / npix;
+  rgb[2] = rgb_sum[2] / npix;
 
-/* image editor */
+  ycc[0] = ycc_sum[0] / npix;
+  ycc[1] = ycc_sum[1] / npix;
+  ycc[2] = ycc_sum[2] / npix;
+
+  /* images smaller than the grid leave sub cells empty */
+  for (g = 0; g < DESC_NCELL; ++g)
+  {
+    for (k = 0; k < 3; ++k)
+    {
+      if (cell_npix[g] == 0) desc[g * 3 + k] = ycc[k];
+      else desc[g * 3 + k] = cell_sum[g * 3 + k] / cell_npix[g];
+    }
+  }
+}
 
-struct tile_node
+static const char* read_line_buf(int fd, char* line_buf, unsigned int size)
 {
-  int x;
-  int y;
-  struct tile_node* next;
-};
+  unsigned int i;
+  for (i = 0; i < size - 1; ++i)
+  {
+    if (read(fd, line_buf + i, 1) != 1)
+    {
+      /* last line without newline */
+      if (i == 0) return NULL;
+      break ;
+    }
+    if (line_buf[i] == '\n') break ;
+  }
+  line_buf[i] = 0;
+  return line_buf;
+}
 
-struct hist_node
+static const char* read_line(int fd)
 {
-  struct index_entry* ie;
-  struct hist_node* next;
-  struct hist_node* prev;
+  static char line_buf[256];
+  return read_line_buf(fd, line_buf, sizeof(line_buf));
+}
+
+struct indexer_entry
+{
+  char* name;
+  unsigned char rgb[3];
+  unsigned char ycc[3];
+  unsigned char desc[DESC_DIM];
+  /* file metadata, to detect changes */
+  uint64_t size;
+  uint64_t mtime;
+  /* computed tile, or position in the previous index if reused */
+  IplImage* thumb;
+  unsigned int prev_id;
 };
 
-struct ed_info
+/* computed entries not yet written, bounds the thumbnails memory */
+#define INDEXER_WINDOW 256
+/* longest file path, and deepest directory scanned */
+#define INDEXER_PATH_MAX 512
+#define INDEXER_MAX_DEPTH 32
+
+struct indexer_info
 {
-  struct mozaic_info* mi;
-  struct index_info* ii;
-  /* arrays of mi->h x mi->w */
-  struct hist_node** hist_arr;
-  struct hist_node** hist_pos;
-  IplImage* ed_im;
-  struct tile_node* sel_tiles;
-  int hs;
-  int ws;
+  const char* dirname;
 
-  unsigned int is_buttondown;
-  unsigned int is_lbutton;
-  int button_tile_x;
-  int button_tile_y;
+  /* sorted file entries, is_done set once an entry is computed */
+  struct indexer_entry* entries;
+  unsigned int n;
+  unsigned int* is_done;
 
-  char line_buf[128];
-  int line_pos;
+  /* entries to compute, and the next one to process */
+  unsigned int* todo;
+  unsigned int ntodo;
+  unsigned int pos;
+
+  /* entries before this one are written */
+  unsigned int nwritten;
+
+  /* growing capacity of entries, while scanning */
+  unsigned int max_n;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
 };
 
-static void redraw_ed(struct ed_info* ei)
+static void* indexer_main(void* param)
 {
-  /* scale down mi->tile_im to ei->ed_im */
+  /* worker, process entries until none is left */
 
-  const int ss = ei->ws * ei->hs;
-  int x;
-  int y;
-  int i;
-  int j;
-  unsigned int sum[3];
-  unsigned char rgb[3];
-  struct tile_node* tn;
+  struct indexer_info* const ji = param;
+  struct indexer_entry* e;
+  char filename[INDEXER_PATH_MAX];
+  IplImage* im;
+  unsigned int is_done;
+  unsigned int i;
 
-  for (y = 0; y < ei->ed_im->height; ++y)
+  while ((i = __sync_fetch_and_add(&ji->pos, 1)) < ji->ntodo)
   {
-    for (x = 0; x < ei->ed_im->width; ++x)
+    i = ji->todo[i];
+    e = &ji->entries[i];
+
+    /* do not get too far ahead of the writer */
+    pthread_mutex_lock(&ji->lock);
+    while (i >= (ji->nwritten + INDEXER_WINDOW))
+      pthread_cond_wait(&ji->cond, &ji->lock);
+    pthread_mutex_unlock(&ji->lock);
+
+    /* decoded once for both the descriptors and the thumbnail */
+    /* 2 if the file is not an image or could not be decoded */
+    is_done = 2;
+
+    im = NULL;
+    if ((entry_path(filename, sizeof(filename), ji->dirname, e->name) == 0)
+	&& is_image_file(filename))
+      im = do_open(filename);
+    if (im != NULL)
     {
-      sum[0] = 0;
-      sum[1] = 0;
-      sum[2] = 0;
-
-      for (i = 0; i < ei->ws; ++i)
-	for (j = 0; j < ei->hs; ++j)
-	{
-	  get_pixel(ei->mi->tile_im, x * ei->ws, y * ei->hs, rgb);
+      CvSize thumb_size;
 
-	  sum[0] += rgb[0];
-	  sum[1] += rgb[1];
-	  sum[2] += rgb[2];
-	}
+      average_image(im, e->rgb, e->ycc, e->desc);
 
-      rgb[0] = sum[0] / ss;
-      rgb[1] = sum[1] / ss;
-      rgb[2] = sum[2] / ss;
+      thumb_size.width = CONFIG_NPIX;
+      thumb_size.height = CONFIG_NPIX;
+      e->thumb = cvCreateImage(thumb_size, IPL_DEPTH_8U, 3);
+      do_reshape(im, e->thumb);
 
-      set_pixel(ei->ed_im, x, y, rgb);
+      cvReleaseImage(&im);
+      is_done = 1;
     }
-  }
 
-  /* put rectangles over selected tiles */
-  for (tn = ei->sel_tiles; tn; tn = tn->next)
-  {
-    const CvScalar purple = cvScalar(0xff, 0, 0xff, 0);
-    CvPoint points[2];
-    const int scaled_x = (tn->x * CONFIG_NPIX) / ei->ws;
-    const int scaled_y = (tn->y * CONFIG_NPIX) / ei->hs;
-    points[0] = cvPoint(scaled_x, scaled_y);
-    points[1] = cvPoint
-      (scaled_x + CONFIG_NPIX / ei->ws, scaled_y + CONFIG_NPIX / ei->hs);
-    cvRectangle(ei->ed_im, points[0], points[1], purple, 2, 8, 0);
+    pthread_mutex_lock(&ji->lock);
+    ji->is_done[i] = is_done;
+    pthread_cond_broadcast(&ji->cond);
+    pthread_mutex_unlock(&ji->lock);
   }
 
-  cvShowImage("ed", ei->ed_im);
+  return NULL;
 }
 
-static void do_make(struct index_info* ii, struct mozaic_info* mi);
-
-static void do_make_sel
-(
- struct index_info* ii,
- struct mozaic_info* mi,
- struct tile_node* tn
-)
+static int cmp_entries(const void* a, const void* b)
 {
-  /* TODO: redundant with do_make */
-
-  CvSize tile_size;
-  CvRect tile_roi;
-  CvSize shap_size;
-
-  /* pixels per tile */
-  const int npix = CONFIG_NPIX;
+  const struct indexer_entry* const ea = a;
+  const struct indexer_entry* const eb = b;
+  return strcmp(ea->name, eb->name);
+}
 
-  tile_size.width = mi->w * npix;
-  tile_size.height = mi->h * npix;
+static struct indexer_entry* index_load_text
+(const char* filename, unsigned int* n)
+{
+  /* load a text index, as written before the binary format, */
+  /* sorted by name. entries without metadata have them set to 0 */
 
-  if (mi->tile_im == NULL)
-    mi->tile_im = cvCreateImage(tile_size, IPL_DEPTH_8U, 3);
+  struct indexer_entry* entries = NULL;
+  unsigned int max_n = 0;
+  const char* line;
+  char name[256];
+  unsigned int rgb[3];
+  unsigned int ycc[3];
+  unsigned long long size;
+  unsigned long long mtime;
+  unsigned int i;
+  int fd;
 
-  shap_size.width = npix;
-  shap_size.height = npix;
+  *n = 0;
 
-  printf("[ do_make ]\n");
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) return NULL;
 
-  for (; tn; tn = tn->next)
+  while ((line = read_line(fd)) != NULL)
   {
-    const int x = tn->x;
-    const int y = tn->y;
+    struct indexer_entry* e;
 
-    struct index_entry* const ie = mi->tile_arr[y * mi->w + x];
+    size = 0;
+    mtime = 0;
 
-    if (ie->cached_im == NULL)
-    {
-      char near_filename[128];
-      IplImage* im_near;
+    if (sscanf
+	(
+	 line, "%255s %02x %02x %02x %02x %02x %02x %llx %llx",
+	 name,
+	 &rgb[0], &rgb[1], &rgb[2],
+	 &ycc[0], &ycc[1], &ycc[2],
+	 &size, &mtime
+	) < 7) continue ;
 
-      /* reshape nearest image */
-      sprintf(near_filename, "%s/%s", ii->dirname, ie->filename);
-      im_near = do_open(near_filename);
-      ie->cached_im = cvCreateImage(shap_size, IPL_DEPTH_8U, 3);
-      do_reshape(im_near, ie->cached_im);
-      cvReleaseImage(&im_near);
+    if (*n == max_n)
+    {
+      max_n = max_n ? max_n * 2 : 1024;
+      entries = realloc(entries, max_n * sizeof(struct indexer_entry));
     }
 
-    /* blit in tile image */
-    tile_roi.x = x * npix;
-    tile_roi.y = y * npix;
-    tile_roi.width = npix;
-    tile_roi.height = npix;
-
-    cvSetImageROI(mi->tile_im, tile_roi);
-    cvCopy(ie->cached_im, mi->tile_im, NULL);
+    e = &entries[(*n)++];
+    e->name = strdup(name);
+    e->rgb[0] = (unsigned char)rgb[0];
+    e->rgb[1] = (unsigned char)rgb[1];
+    e->rgb[2] = (unsigned char)rgb[2];
+    e->ycc[0] = (unsigned char)ycc[0];
+    e->ycc[1] = (unsigned char)ycc[1];
+    e->ycc[2] = (unsigned char)ycc[2];
+    e->size = size;
+    e->mtime = mtime;
+    e->thumb = NULL;
+    e->prev_id = INDEX_NONE;
+
+    /* no sub cells in text indices, use the mean everywhere */
+    for (i = 0; i < DESC_DIM; ++i) e->desc[i] = e->ycc[i % 3];
   }
 
-  cvResetImageROI(mi->tile_im);
+  close(fd);
+
+  qsort(entries, *n, sizeof(struct indexer_entry), cmp_entries);
+
+  return entries;
 }
 
-static void on_mouse(int event, int x, int y, int flags, void* param)
+static struct indexer_entry* indexer_load_prev
+(const char* filename, unsigned int* n, struct index_header* h)
 {
-  struct ed_info* const ei = param;
-
-  switch (event)
-  {
-  case CV_EVENT_RBUTTONDOWN:
-  case CV_EVENT_LBUTTONDOWN:
-    {
-      if (ei->is_buttondown) break ;
+  /* load a previous binary index, sorted by name */
 
-      ei->is_buttondown = 1;
+  struct index_map map;
+  struct indexer_entry* entries;
+  unsigned int i;
 
-      if (event == CV_EVENT_LBUTTONDOWN) ei->is_lbutton = 1;
-      else ei->is_lbutton = 0;
+  *n = 0;
 
-      ei->button_tile_x = (x * ei->ws) / CONFIG_NPIX;
-      ei->button_tile_y = (y * ei->hs) / CONFIG_NPIX;
+  if (index_map_open(&map, filename)) return NULL;
 
-      goto cv_event_mousemove_case;
+  entries = malloc(map.h->count * sizeof(struct indexer_entry));
 
-      break ;
-    }
+  for (i = 0; i < map.h->count; ++i)
+  {
+    const struct index_record* const r = &map.recs[i];
+    struct indexer_entry* const e = &entries[i];
+
+    e->name = strdup(map.strtab + r->name_off);
+    memcpy(e->rgb, r->rgb, sizeof(e->rgb));
+    memcpy(e->ycc, r->ycc, sizeof(e->ycc));
+    memcpy(e->desc, r->desc, sizeof(e->desc));
+    e->size = r->size;
+    e->mtime = r->mtime;
+    e->thumb = NULL;
+    e->prev_id = i;
+  }
 
-  case CV_EVENT_RBUTTONUP:
-  case CV_EVENT_LBUTTONUP:
-    {
-      ei->is_buttondown = 0;
-      break ;
-    }
+  *n = map.h->count;
+  *h = *map.h;
 
-  case CV_EVENT_MOUSEMOVE:
-  cv_event_mousemove_case:
-    {
-      unsigned int is_update = 0;
-      struct tile_node* tn;
-      int tile_x;
-      int tile_y;
-      int min_tile_x;
-      int max_tile_x;
-      int min_tile_y;
-      int max_tile_y;
+  index_map_close(&map);
 
-      if (ei->is_buttondown == 0) break ;
+  qsort(entries, *n, sizeof(struct indexer_entry), cmp_entries);
 
-      tile_x = (x * ei->ws) / CONFIG_NPIX;
-      tile_y = (y * ei->hs) / CONFIG_NPIX;
+  return entries;
+}
 
-      min_tile_x = tile_x < ei->button_tile_x ? tile_x : ei->button_tile_x;
-      max_tile_x = tile_x > ei->button_tile_x ? tile_x : ei->button_tile_x;
-      min_tile_y = tile_y < ei->button_tile_y ? tile_y : ei->button_tile_y;
-      max_tile_y = tile_y > ei->button_tile_y ? tile_y : ei->button_tile_y;
+struct index_writer
+{
+  struct index_record* recs;
+  unsigned int n;
+  unsigned int max_n;
+  char* strtab;
+  size_t strtab_size;
+  size_t max_strtab_size;
+};
 
-      for (y = min_tile_y; y <= max_tile_y; ++y)
-      {
-	for (x = min_tile_x; x <= max_tile_x; ++x)
-	{
-	  /* select */
-	  if (ei->is_lbutton)
-	  {
-	    for (tn = ei->sel_tiles; tn; tn = tn->next)
-	      if ((tn->x == x) && (tn->y == y))
-		break ;
-
-	    /* not yet selected, add */
-	    if (tn == NULL)
-	    {
-	      tn = malloc(sizeof(struct tile_node));
-	      tn->x = x;
-	      tn->y = y;
-	      tn->next = ei->sel_tiles;
-	      ei->sel_tiles = tn;
-	      is_update = 1;
-	    }
-	  }
-	  else /* unselect */
-	  {
-	    struct tile_node* pre = NULL;
-
-	    for (tn = ei->sel_tiles; tn; tn = tn->next)
-	    {
-	      if ((tn->x == x) && (tn->y == y))
-		break ;
-	      pre = tn;
-	    }
-
-	    if (tn != NULL)
-	    {
-	      if (pre) pre->next = tn->next;
-	      else ei->sel_tiles = tn->next;
-	      free(tn);
-	      is_update = 1;
-	    }
-	  }
-	}
-      }
+static void index_writer_init(struct index_writer* iw)
+{
+  iw->recs = NULL;
+  iw->n = 0;
+  iw->max_n = 0;
+  iw->strtab = NULL;
+  iw->strtab_size = 0;
+  iw->max_strtab_size = 0;
+}
 
-      if (is_update)
-      {
-	do_make_sel(ei->ii, ei->mi, ei->sel_tiles);
-	redraw_ed(ei);
-      }
+static void index_writer_add
+(struct index_writer* iw, const struct indexer_entry* e)
+{
+  const size_t len = strlen(e->name) + 1;
+  struct index_record* r;
 
-      break ;
-    }
+  if (iw->n == iw->max_n)
+  {
+    iw->max_n = iw->max_n ? iw->max_n * 2 : 1024;
+    iw->recs = realloc(iw->recs, iw->max_n * sizeof(struct index_record));
+  }
 
-  default: break ;
+  while ((iw->strtab_size + len) > iw->max_strtab_size)
+  {
+    iw->max_strtab_size = iw->max_strtab_size ? iw->max_strtab_size * 2 : 4096;
+    iw->strtab = realloc(iw->strtab, iw->max_strtab_size);
   }
+
+  r = &iw->recs[iw->n++];
+  memset(r, 0, sizeof(struct index_record));
+  r->name_off = (uint32_t)iw->strtab_size;
+  memcpy(r->rgb, e->rgb, sizeof(r->rgb));
+  memcpy(r->ycc, e->ycc, sizeof(r->ycc));
+  memcpy(r->desc, e->desc, sizeof(r->desc));
+  r->size = e->size;
+  r->mtime = e->mtime;
+
+  memcpy(iw->strtab + iw->strtab_size, e->name, len);
+  iw->strtab_size += len;
 }
 
-static struct index_entry* index_find_exclude_hist
-(
- struct index_info* ii,
- const unsigned char* rgb,
- const unsigned char* ycc,
- struct hist_node* hn
-)
+static int index_writer_fini
+(struct index_writer* iw, const char* dirname, uint32_t stamp)
 {
-  struct index_entry* ie;
-  unsigned int best_dist = (unsigned int)-1;
-  struct index_entry* best_ie = NULL;
+  /* written aside then renamed, the previous index stays valid */
 
-  for (ie = ii->ie; ie; ie = ie->next)
-  {
-    struct hist_node* pos;
-    unsigned int this_dist;
+  struct index_header h;
+  char filename[INDEXER_PATH_MAX];
+  char tmp_filename[INDEXER_PATH_MAX];
+  size_t recs_size;
+  int err = -1;
+  int fd;
 
-    /* skip tile if in history */
-    for (pos = hn; pos; pos = pos->next)
-      if (pos->ie == ie) break ;
-    if (pos) continue ;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, 4);
+  h.version = INDEX_VERSION;
+  h.count = iw->n;
+  h.rec_size = sizeof(struct index_record);
+  recs_size = iw->n * sizeof(struct index_record);
+  h.strtab_off = sizeof(h) + recs_size;
+  h.strtab_size = iw->strtab_size;
+  h.ngrid = CONFIG_NGRID;
+  h.stamp = stamp;
+
+  if (dir_path(filename, sizeof(filename), dirname, "tilit_index"))
+    goto on_error;
+  if (dir_path
+      (tmp_filename, sizeof(tmp_filename), dirname, "tilit_index.tmp"))
+    goto on_error;
+
+  fd = open(tmp_filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (fd == -1) goto on_error;
+
+  if (write(fd, &h, sizeof(h)) != sizeof(h)) goto on_error_close;
+  if (write(fd, iw->recs, recs_size) != (ssize_t)recs_size)
+    goto on_error_close;
+  if (write(fd, iw->strtab, iw->strtab_size) != (ssize_t)iw->strtab_size)
+    goto on_error_close;
 
-    this_dist = compute_dist(ycc, ie->ycc);
-    if (this_dist < best_dist)
-    {
-      best_dist = this_dist;
-      best_ie = ie;
-    }
-  }
+  close(fd);
+  fd = -1;
 
-  return best_ie;
+  if (rename(tmp_filename, filename)) goto on_error;
+
+  err = 0;
+
+ on_error_close:
+  if (fd != -1) close(fd);
+ on_error:
+  free(iw->recs);
+  free(iw->strtab);
+  return err;
 }
 
-static void do_edit(struct index_info* ii, struct mozaic_info* mi)
+struct atlas_writer
 {
-  struct ed_info ei;
-  CvSize ed_size;
-  int is_done = 0;
-  int is_update;
-  int i;
+  int fd;
+  unsigned int n;
+};
 
-  ei.ii = ii;
-  ei.mi = mi;
+static int atlas_writer_init(struct atlas_writer* aw, const char* dirname)
+{
+  /* the header is written by atlas_writer_fini */
 
-  ei.line_pos = 0;
-  ei.is_buttondown = 0;
+  char filename[INDEXER_PATH_MAX];
 
-  ei.sel_tiles = NULL;
+  aw->fd = -1;
+  if (dir_path(filename, sizeof(filename), dirname, "tilit_atlas.tmp"))
+    return -1;
+  aw->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (aw->fd == -1) return -1;
 
-  ei.hs = mi->tile_im->height / 700;
-  ei.ws = ei.hs;
+  aw->n = 0;
+  lseek(aw->fd, sizeof(struct atlas_header), SEEK_SET);
 
-  ed_size.height = mi->tile_im->height / ei.hs;
-  ed_size.width = mi->tile_im->width / ei.ws;
-  ei.ed_im = cvCreateImage(ed_size, IPL_DEPTH_8U, 3);
+  return 0;
+}
 
-  do_make(ii, mi);
-  redraw_ed(&ei);
+static void atlas_writer_add
+(struct atlas_writer* aw, const unsigned char* pix, int step)
+{
+  /* step the distance between 2 rows in pix */
 
-  /* initialize hist related arrays */
-  ei.hist_pos = malloc(mi->w * mi->h * sizeof(struct hist_node*));
-  ei.hist_arr = malloc(mi->w * mi->h * sizeof(struct hist_node*));
-  for (i = 0; i < (mi->w * mi->h); ++i)
-  {
-    struct hist_node* hn;
+  const int row_size = CONFIG_NPIX * 3;
+  int y;
 
-    hn = malloc(sizeof(struct hist_node));
-    hn->ie = ei.mi->tile_arr[i];
-    hn->next = NULL;
-    hn->prev = NULL;
+  if (aw->fd == -1) return ;
 
-    ei.hist_arr[i] = hn;
-    ei.hist_pos[i] = hn;
+  if (step == row_size)
+  {
+    if (write(aw->fd, pix, ATLAS_TILE_SIZE) != ATLAS_TILE_SIZE)
+      goto on_error;
   }
-
-  /* setup ui */
-  cvNamedWindow("ed", CV_WINDOW_AUTOSIZE);
-  cvShowImage("ed", ei.ed_im);
-  cvSetMouseCallback("ed", on_mouse, (void*)&ei);
-
-  while (is_done == 0)
+  else
   {
-    const int k = cvWaitKey(0);
+    for (y = 0; y < CONFIG_NPIX; ++y, pix += step)
+      if (write(aw->fd, pix, row_size) != row_size) goto on_error;
+  }
 
-    is_update = 0;
-    switch (k & 0xff)
-    {
-      /* left arrow, select the next less matching tile */
-    case 0x51:
-      {
-	struct tile_node* tn;
+  ++aw->n;
+  return ;
 
-	for (tn = ei.sel_tiles; tn; tn = tn->next)
-	{
-	  i = tn->y * mi->w + tn->x;
-
-	  if (ei.hist_pos[i]->prev)
-	  {
-	    /* already one previous tile */
-	    ei.hist_pos[i] = ei.hist_pos[i]->prev;
-	  }
-	  else
-	  {
-	    /* select the next non used tile */
-
-	    struct index_entry* ie;
-	    struct hist_node* hn;
-	    unsigned char rgb[3] = { 0, 0, 0 };
-	    unsigned char ycc[3];
-
-	    get_pixel_ycc(mi->ycc_im, tn->x, tn->y, ycc);
-	    ie = index_find_exclude_hist(ii, rgb, ycc, ei.hist_arr[i]);
-	    if (ie)
-	    {
-	      hn = malloc(sizeof(struct hist_node));
-	      hn->ie = ie;
-	      hn->prev = NULL;
-	      hn->next = ei.hist_pos[i];
-	      ei.hist_pos[i] = hn;
-	      ei.hist_arr[i] = hn;
-	    }
-	  }
-
-	  mi->tile_arr[i] = ei.hist_pos[i]->ie;
-	}
+ on_error:
+  close(aw->fd);
+  aw->fd = -1;
+}
 
-	is_update = 1;
+static int atlas_writer_fini
+(struct atlas_writer* aw, const char* dirname, uint32_t stamp)
+{
+  struct atlas_header h;
+  char filename[INDEXER_PATH_MAX];
+  char tmp_filename[INDEXER_PATH_MAX];
 
-	break ;
+  if (dir_path(filename, sizeof(filename), dirname, "tilit_atlas") ||
+      dir_path
+      (tmp_filename, sizeof(tmp_filename), dirname, "tilit_atlas.tmp"))
+  {
+    if (aw->fd != -1) close(aw->fd);
+    return -1;
+  }
+
+  if (aw->fd == -1)
+  {
+    unlink(tmp_filename);
+    return -1;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, ATLAS_MAGIC, 4);
+  h.version = ATLAS_VERSION;
+  h.count = aw->n;
+  h.npix = CONFIG_NPIX;
+  h.stamp = stamp;
+  h.data_off = sizeof(h);
+
+  lseek(aw->fd, 0, SEEK_SET);
+  if (write(aw->fd, &h, sizeof(h)) != sizeof(h))
+  {
+    close(aw->fd);
+    unlink(tmp_filename);
+    return -1;
+  }
+
+  close(aw->fd);
+
+  return rename(tmp_filename, filename);
+}
+
+static int do_convert(const char* dirname)
+{
+  /* convert a text tilit_index to the binary format */
+
+  struct index_writer iw;
+  struct indexer_entry* entries;
+  char filename[INDEXER_PATH_MAX];
+  unsigned int n;
+  unsigned int i;
+  int err;
+
+  if (dir_path(filename, sizeof(filename), dirname, "tilit_index"))
+    return -1;
+  entries = index_load_text(filename, &n);
+  if (entries == NULL) return -1;
+
+  index_writer_init(&iw);
+  for (i = 0; i < n; ++i)
+  {
+    index_writer_add(&iw, &entries[i]);
+    free(entries[i].name);
+  }
+  free(entries);
+
+  /* no atlas, tiles are decoded at render time until reindexed */
+  err = index_writer_fini(&iw, dirname, 0);
+  printf("[ do_convert ] %u entries\n", n);
+
+  return err;
+}
+
+static void indexer_scan
+(struct indexer_info* ji, char* path, size_t name_off, unsigned int depth)
+{
+  /* add the regular files under the directory path, recursively. */
+  /* entry names start at path + name_off. path has room for */
+  /* INDEXER_PATH_MAX bytes and is restored on return */
+
+  const size_t len = strlen(path);
+  struct indexer_entry* e;
+  struct dirent* dent;
+  struct stat st;
+  DIR* dirp;
+
+  if (depth > INDEXER_MAX_DEPTH) return ;
+
+  dirp = opendir(path);
+  if (dirp == NULL) return ;
+
+  while ((dent = readdir(dirp)) != NULL)
+  {
+    /* hidden, . and .. included, and the index files */
+    if (dent->d_name[0] == '.') continue ;
+    if (strcmp(dent->d_name, "tilit_index") == 0) continue ;
+    if (strcmp(dent->d_name, "tilit_index.tmp") == 0) continue ;
+    if (strcmp(dent->d_name, "tilit_atlas") == 0) continue ;
+    if (strcmp(dent->d_name, "tilit_atlas.tmp") == 0) continue ;
+
+    if ((len + 1 + strlen(dent->d_name)) >= INDEXER_PATH_MAX) continue ;
+    path[len] = '/';
+    strcpy(path + len + 1, dent->d_name);
+
+#ifdef _WIN32
+    if (stat(path, &st)) continue ;
+#else
+    /* linked files are indexed but linked directories are not */
+    /* followed, a link loop would index the same files again */
+    if (lstat(path, &st)) continue ;
+    if (S_ISLNK(st.st_mode))
+    {
+      if (stat(path, &st) || S_ISDIR(st.st_mode)) continue ;
+    }
+#endif
+
+    if (S_ISDIR(st.st_mode))
+    {
+      indexer_scan(ji, path, name_off, depth + 1);
+      continue ;
+    }
+
+    if (S_ISREG(st.st_mode) == 0) continue ;
+
+    if (ji->n == ji->max_n)
+    {
+      ji->max_n = ji->max_n ? ji->max_n * 2 : 1024;
+      ji->entries = realloc
+	(ji->entries, ji->max_n * sizeof(struct indexer_entry));
+    }
+
+    e = &ji->entries[ji->n++];
+    e->name = strdup(path + name_off);
+    e->size = (uint64_t)st.st_size;
+    e->mtime = (uint64_t)st.st_mtime;
+    e->thumb = NULL;
+    e->prev_id = INDEX_NONE;
+  }
+
+  path[len] = 0;
+  closedir(dirp);
+}
+
+static void do_index
+(
+ const char* dirname,
+ const char* const* roots,
+ unsigned int nroot,
+ unsigned int nthread,
+ unsigned int is_incremental
+)
+{
+  /* foreach image under dirname and the other roots, compute the */
+  /* descriptors and the tile, into one index in dirname. files */
+  /* under dirname are named relative to it, other ones by their */
+  /* absolute path. non images are rejected by their signature */
+  /* files are processed by a pool of worker threads while this */
+  /* thread, the only writer, appends records in sorted name order */
+  /* in incremental mode, entries of the previous index whose size */
+  /* and mtime did not change are reused instead of recomputed */
+
+  struct indexer_info ji;
+  struct index_writer iw;
+  struct atlas_writer aw;
+  struct indexer_entry* prev = NULL;
+  unsigned int nprev = 0;
+  struct index_header prev_h;
+  struct atlas_map prev_atlas;
+  pthread_t* threads;
+  uint32_t stamp;
+  char filename[INDEXER_PATH_MAX];
+  struct stat st;
+  unsigned int nentry;
+  unsigned int i;
+
+  if (stat(dirname, &st) || (S_ISDIR(st.st_mode) == 0)) return ;
+
+  /* the longest file written in dirname, tilit_index.tmp as long */
+  if ((strlen(dirname) + sizeof("/tilit_atlas.tmp")) > INDEXER_PATH_MAX)
+  {
+    printf("index directory name too long\n");
+    return ;
+  }
+
+  ji.dirname = dirname;
+  ji.n = 0;
+  ji.entries = NULL;
+  ji.max_n = 0;
+
+  strcpy(filename, dirname);
+  indexer_scan(&ji, filename, strlen(filename) + 1, 0);
+
+  for (i = 0; i < nroot; ++i)
+  {
+#ifdef _WIN32
+    if (_fullpath(filename, roots[i], sizeof(filename)) == NULL)
+#else
+    char abs_path[PATH_MAX];
+    if ((realpath(roots[i], abs_path) == NULL) ||
+	(strlen(abs_path) >= sizeof(filename)))
+#endif
+    {
+      printf("invalid root %s\n", roots[i]);
+      continue ;
+    }
+#ifndef _WIN32
+    strcpy(filename, abs_path);
+#endif
+    indexer_scan(&ji, filename, 0, 0);
+  }
+
+  /* readdir order is unspecified, keep the index stable */
+  qsort(ji.entries, ji.n, sizeof(struct indexer_entry), cmp_entries);
+
+  if (is_incremental &&
+      (dir_path(filename, sizeof(filename), dirname, "tilit_index") == 0))
+    prev = indexer_load_prev(filename, &nprev, &prev_h);
+
+  /* previous tiles are needed to reuse entries */
+  if (nprev)
+  {
+    if (dir_path(filename, sizeof(filename), dirname, "tilit_atlas") ||
+	atlas_map_open(&prev_atlas, filename, &prev_h))
+    {
+      for (i = 0; i < nprev; ++i) free(prev[i].name);
+      free(prev);
+      prev = NULL;
+      nprev = 0;
+    }
+  }
+
+  /* reuse unchanged entries, schedule the others */
+  ji.is_done = calloc(ji.n, sizeof(unsigned int));
+  ji.todo = malloc(ji.n * sizeof(unsigned int));
+  ji.ntodo = 0;
+
+  for (i = 0; i < ji.n; ++i)
+  {
+    struct indexer_entry* const e = &ji.entries[i];
+    const struct indexer_entry* const p = nprev ?
+      bsearch(e, prev, nprev, sizeof(struct indexer_entry), cmp_entries) :
+      NULL;
+
+    if ((p != NULL) && (p->size == e->size) && (p->mtime == e->mtime))
+    {
+      memcpy(e->rgb, p->rgb, sizeof(e->rgb));
+      memcpy(e->ycc, p->ycc, sizeof(e->ycc));
+      memcpy(e->desc, p->desc, sizeof(e->desc));
+      e->prev_id = p->prev_id;
+      ji.is_done[i] = 1;
+      continue ;
+    }
+
+    ji.todo[ji.ntodo++] = i;
+  }
+
+  printf("[ do_index ] %u files, %u to compute\n", ji.n, ji.ntodo);
+
+  ji.pos = 0;
+  ji.nwritten = 0;
+  pthread_mutex_init(&ji.lock, NULL);
+  pthread_cond_init(&ji.cond, NULL);
+
+  nthread = get_nthread(nthread);
+  if (nthread > ji.ntodo) nthread = ji.ntodo;
+  threads = malloc((nthread + 1) * sizeof(pthread_t));
+  for (i = 0; i < nthread; ++i)
+    pthread_create(&threads[i], NULL, indexer_main, &ji);
+
+  index_writer_init(&iw);
+  atlas_writer_init(&aw, dirname);
+  nentry = 0;
+
+  for (i = 0; i < ji.n; ++i)
+  {
+    struct indexer_entry* const e = &ji.entries[i];
+
+    pthread_mutex_lock(&ji.lock);
+    while (ji.is_done[i] == 0) pthread_cond_wait(&ji.cond, &ji.lock);
+    pthread_mutex_unlock(&ji.lock);
+
+    if (ji.is_done[i] == 1)
+    {
+      index_writer_add(&iw, e);
+      ++nentry;
+
+      if (e->thumb != NULL)
+      {
+	const unsigned char* const pix = (const unsigned char*)
+	  e->thumb->imageData;
+	atlas_writer_add(&aw, pix, e->thumb->widthStep);
+	cvReleaseImage(&e->thumb);
+      }
+      else
+      {
+	const unsigned char* const pix =
+	  prev_atlas.data + (size_t)e->prev_id * ATLAS_TILE_SIZE;
+	atlas_writer_add(&aw, pix, CONFIG_NPIX * 3);
+      }
+    }
+
+    pthread_mutex_lock(&ji.lock);
+    ji.nwritten = i + 1;
+    pthread_cond_broadcast(&ji.cond);
+    pthread_mutex_unlock(&ji.lock);
+  }
+
+  /* the index is renamed last, it validates the atlas */
+  stamp = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+  if (atlas_writer_fini(&aw, dirname, stamp)) stamp = 0;
+  index_writer_fini(&iw, dirname, stamp);
+
+  for (i = 0; i < nthread; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+
+  printf("[ do_index ] %u entries, %u rejected\n", nentry, ji.n - nentry);
+
+  pthread_cond_destroy(&ji.cond);
+  pthread_mutex_destroy(&ji.lock);
+
+  if (nprev) atlas_map_close(&prev_atlas);
+  for (i = 0; i < nprev; ++i) free(prev[i].name);
+  free(prev);
+
+  for (i = 0; i < ji.n; ++i) free(ji.entries[i].name);
+  free(ji.entries);
+  free(ji.is_done);
+  free(ji.todo);
+}
+
+
+/* tile cache. when there is no atlas, library images are decoded */
+/* and reshaped at render time. decoded tiles are kept in a bounded */
+/* number of slots, and the least recently used unpinned one is */
+/* reused on a miss. a slot is pinned while its pixels are in use */
+/* and goes over the budget only if all the others are pinned */
+
+#define TILE_NONE ((unsigned int)-1)
+
+struct tile_slot
+{
+  IplImage* im;
+  unsigned int id;
+  unsigned int pin;
+  unsigned int is_ready;
+  /* lru list of unpinned slots, or free list */
+  unsigned int prev;
+  unsigned int next;
+};
+
+struct tile_cache
+{
+  /* slot of each index entry, or TILE_NONE */
+  unsigned int* slot_of;
+
+  struct tile_slot* slots;
+  unsigned int nslot;
+  unsigned int max_nslot;
+  unsigned int nlive;
+  unsigned int budget;
+
+  /* most and least recently used unpinned slots, unused slots */
+  unsigned int lru_head;
+  unsigned int lru_tail;
+  unsigned int free_head;
+
+  unsigned long nhit;
+  unsigned long nmiss;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void tile_cache_init
+(struct tile_cache* tc, unsigned int n, size_t size)
+{
+  unsigned int i;
+
+  tc->slot_of = malloc(n * sizeof(unsigned int));
+  for (i = 0; i < n; ++i) tc->slot_of[i] = TILE_NONE;
+
+  tc->slots = NULL;
+  tc->nslot = 0;
+  tc->max_nslot = 0;
+  tc->nlive = 0;
+  tc->budget = (unsigned int)(size / (CONFIG_NPIX * CONFIG_NPIX * 3));
+  if (tc->budget == 0) tc->budget = 1;
+
+  tc->lru_head = TILE_NONE;
+  tc->lru_tail = TILE_NONE;
+  tc->free_head = TILE_NONE;
+
+  tc->nhit = 0;
+  tc->nmiss = 0;
+
+  pthread_mutex_init(&tc->lock, NULL);
+  pthread_cond_init(&tc->cond, NULL);
+}
+
+static void tile_cache_fini(struct tile_cache* tc)
+{
+  unsigned int i;
+
+  for (i = 0; i < tc->nslot; ++i)
+  {
+    if (tc->slots[i].im != NULL) cvReleaseImage(&tc->slots[i].im);
+  }
+
+  free(tc->slots);
+  free(tc->slot_of);
+
+  pthread_cond_destroy(&tc->cond);
+  pthread_mutex_destroy(&tc->lock);
+}
+
+static void tile_cache_unlink(struct tile_cache* tc, unsigned int i)
+{
+  struct tile_slot* const ts = &tc->slots[i];
+
+  if (ts->prev != TILE_NONE) tc->slots[ts->prev].next = ts->next;
+  else tc->lru_head = ts->next;
+
+  if (ts->next != TILE_NONE) tc->slots[ts->next].prev = ts->prev;
+  else tc->lru_tail = ts->prev;
+}
+
+static unsigned int tile_cache_alloc(struct tile_cache* tc)
+{
+  /* a slot for a new tile, reuse the least recently used one */
+  /* when the budget is reached. the lock is held */
+
+  unsigned int i;
+
+  if ((tc->nlive >= tc->budget) && (tc->lru_tail != TILE_NONE))
+  {
+    i = tc->lru_tail;
+    tile_cache_unlink(tc, i);
+    tc->slot_of[tc->slots[i].id] = TILE_NONE;
+    return i;
+  }
+
+  ++tc->nlive;
+
+  if (tc->free_head != TILE_NONE)
+  {
+    i = tc->free_head;
+    tc->free_head = tc->slots[i].next;
+    return i;
+  }
+
+  if (tc->nslot == tc->max_nslot)
+  {
+    tc->max_nslot = tc->max_nslot ? tc->max_nslot * 2 : 64;
+    tc->slots = realloc(tc->slots, tc->max_nslot * sizeof(struct tile_slot));
+  }
+
+  i = tc->nslot++;
+  tc->slots[i].im = NULL;
+  return i;
+}
+
+static IplImage* tile_cache_get
+(struct tile_cache* tc, unsigned int id, unsigned int* is_miss)
+{
+  /* pin the tile of entry id. on a miss, the caller fills the */
+  /* returned image then calls tile_cache_ready */
+
+  struct tile_slot* ts;
+  IplImage* im;
+  unsigned int i;
+
+  pthread_mutex_lock(&tc->lock);
+
+  i = tc->slot_of[id];
+
+  if (i != TILE_NONE)
+  {
+    ++tc->nhit;
+    *is_miss = 0;
+
+    if ((tc->slots[i].pin++) == 0) tile_cache_unlink(tc, i);
+
+    /* being filled by another thread */
+    while (tc->slots[i].is_ready == 0)
+      pthread_cond_wait(&tc->cond, &tc->lock);
+
+    ts = &tc->slots[i];
+  }
+  else
+  {
+    ++tc->nmiss;
+    *is_miss = 1;
+
+    i = tile_cache_alloc(tc);
+    tc->slot_of[id] = i;
+
+    ts = &tc->slots[i];
+    ts->id = id;
+    ts->pin = 1;
+    ts->is_ready = 0;
+
+    if (ts->im == NULL)
+    {
+      CvSize tile_size;
+      tile_size.width = CONFIG_NPIX;
+      tile_size.height = CONFIG_NPIX;
+      ts->im = cvCreateImage(tile_size, IPL_DEPTH_8U, 3);
+    }
+  }
+
+  /* slots may be reallocated once unlocked */
+  im = ts->im;
+
+  pthread_mutex_unlock(&tc->lock);
+
+  return im;
+}
+
+static void tile_cache_ready(struct tile_cache* tc, unsigned int id)
+{
+  pthread_mutex_lock(&tc->lock);
+  tc->slots[tc->slot_of[id]].is_ready = 1;
+  pthread_cond_broadcast(&tc->cond);
+  pthread_mutex_unlock(&tc->lock);
+}
+
+static void tile_cache_put(struct tile_cache* tc, unsigned int id)
+{
+  /* unpin the tile of entry id */
+
+  struct tile_slot* ts;
+  unsigned int i;
+
+  pthread_mutex_lock(&tc->lock);
+
+  i = tc->slot_of[id];
+  ts = &tc->slots[i];
+
+  if ((--ts->pin) == 0)
+  {
+    if (tc->nlive > tc->budget)
+    {
+      /* over the budget, release the slot */
+      tc->slot_of[id] = TILE_NONE;
+      cvReleaseImage(&ts->im);
+      ts->next = tc->free_head;
+      tc->free_head = i;
+      --tc->nlive;
+    }
+    else
+    {
+      /* most recently used */
+      ts->prev = TILE_NONE;
+      ts->next = tc->lru_head;
+      if (tc->lru_head != TILE_NONE) tc->slots[tc->lru_head].prev = i;
+      else tc->lru_tail = i;
+      tc->lru_head = i;
+    }
+  }
+
+  pthread_mutex_unlock(&tc->lock);
+}
+
+static void tile_cache_print(const struct tile_cache* tc)
+{
+  printf("[ tile_cache ] %lu hits, %lu misses, %u tiles\n",
+	 tc->nhit, tc->nmiss, tc->nlive);
+}
+
+
+/* index */
+
+/* queries before a chosen entry can be chosen again, so that a */
+/* tile can appear 1.5 lines later with ntil tiles per line */
+#define INDEX_PENALTY(ntil) ((3 * (ntil)) / 2)
+
+struct index_tree;
+static void index_tree_free(struct index_tree*);
+struct index_pq;
+static void index_pq_free(struct index_pq*);
+
+struct index_info
+{
+  unsigned int n;
+
+  /* search data, contiguous arrays of n items. desc holds the */
+  /* padded descriptors, so that vector code loads a whole number */
+  /* of them at once. searches do not modify the index, it can be */
+  /* shared by threads and jobs, see pick_info */
+  unsigned char* desc;
+
+  /* optional k-d tree over the descriptors */
+  struct index_tree* tree;
+
+  /* optional quantized codes, desc is then NULL if the index was */
+  /* loaded from a file */
+  struct index_pq* pq;
+
+  /* cold data, only used for rendering. tiles come from the atlas */
+  /* when there is one, else they are decoded and cached */
+  struct tile_cache tiles;
+  struct atlas_map atlas;
+  unsigned int has_atlas;
+
+  struct index_map map;
+  char dirname[INDEXER_PATH_MAX];
+};
+
+static inline const char* index_filename
+(const struct index_info* ii, unsigned int id)
+{
+  return ii->map.strtab + ii->map.recs[id].name_off;
+}
+
+static inline const unsigned char* index_desc
+(const struct index_info* ii, unsigned int id)
+{
+  /* exact descriptor of entry id, in memory or in the index file */
+  if (ii->desc != NULL) return ii->desc + id * DESC_STRIDE;
+  return ii->map.recs[id].desc;
+}
+
+static int index_load(struct index_info* ii, const char* dirname)
+{
+  const uint64_t t = stats_start();
+  char filename[INDEXER_PATH_MAX];
+  unsigned int i;
+
+  ii->n = 0;
+
+  /* tilit_index and tilit_atlas have the same length */
+  if ((strlen(dirname) + sizeof("/tilit_index")) > sizeof(filename))
+  {
+    printf("index directory name too long\n");
+    return -1;
+  }
+
+  snprintf(ii->dirname, sizeof(ii->dirname), "%s", dirname);
+  snprintf(filename, sizeof(filename), "%s/tilit_index", dirname);
+
+  if (index_map_open(&ii->map, filename))
+  {
+    printf("invalid index %s, run convert or index\n", filename);
+    return -1;
+  }
+
+  if (ii->map.h->count == 0)
+  {
+    printf("empty index %s\n", filename);
+    index_map_close(&ii->map);
+    return -1;
+  }
+
+  snprintf(filename, sizeof(filename), "%s/tilit_atlas", dirname);
+  ii->has_atlas = (atlas_map_open(&ii->atlas, filename, ii->map.h) == 0);
+  if (ii->has_atlas == 0) printf("no atlas, tiles will be decoded\n");
+
+  ii->n = ii->map.h->count;
+  ii->desc = calloc(ii->n, DESC_STRIDE);
+  ii->tree = NULL;
+  ii->pq = NULL;
+  if (ii->has_atlas == 0) tile_cache_init(&ii->tiles, ii->n, CONFIG_TILE_CACHE);
+
+  for (i = 0; i < ii->n; ++i)
+  {
+    const struct index_record* const r = &ii->map.recs[i];
+    memcpy(ii->desc + i * DESC_STRIDE, r->desc, DESC_DIM);
+  }
+
+  stats_add(&stats.index_bytes, ii->map.size);
+  stats_stop(&stats.index_load, t);
+
+  return 0;
+}
+
+static void index_free(struct index_info* ii)
+{
+  if (ii->has_atlas == 0) tile_cache_fini(&ii->tiles);
+  if (ii->tree != NULL) index_tree_free(ii->tree);
+  if (ii->pq != NULL) index_pq_free(ii->pq);
+  free(ii->desc);
+  if (ii->has_atlas) atlas_map_close(&ii->atlas);
+  index_map_close(&ii->map);
+}
+
+/* repetition constraint of a mosaic, apart from the shared index. */
+/* an entry chosen by a query can be chosen again penalty queries */
+/* later. ban holds the query count from which each entry is */
+/* allowed, so that skipping one is a compare and a query only */
+/* writes the entry it chooses. the first entry is never banned */
+
+struct pick_info
+{
+  unsigned int* ban;
+  unsigned int nquery;
+  unsigned int penalty;
+};
+
+static void pick_init
+(struct pick_info* pi, const struct index_info* ii, int ntil)
+{
+  pi->ban = calloc(ii->n, sizeof(unsigned int));
+  pi->nquery = 0;
+  pi->penalty = INDEX_PENALTY(ntil);
+}
+
+static void pick_fini(struct pick_info* pi)
+{
+  free(pi->ban);
+}
+
+static inline unsigned int is_banned
+(const struct pick_info* pi, unsigned int id)
+{
+  return pi->nquery < pi->ban[id];
+}
+
+static inline void pick_take(struct pick_info* pi, unsigned int id)
+{
+  pi->ban[id] = pi->nquery + pi->penalty;
+  ++pi->nquery;
+}
+
+static const unsigned char* index_get_tile
+(struct index_info* ii, unsigned int id, int* step)
+{
+  /* CONFIG_NPIX x CONFIG_NPIX bgr pixels of entry id, step the */
+  /* distance between 2 rows. valid until index_put_tile */
+
+  IplImage* im;
+  unsigned int is_miss;
+
+  if (ii->has_atlas)
+  {
+    stats_add(&stats.atlas_bytes, ATLAS_TILE_SIZE);
+    *step = CONFIG_NPIX * 3;
+    return ii->atlas.data + (size_t)id * ATLAS_TILE_SIZE;
+  }
+
+  im = tile_cache_get(&ii->tiles, id, &is_miss);
+  stats_add(is_miss ? &stats.tile_miss : &stats.tile_hit, 1);
+
+  if (is_miss)
+  {
+    char near_filename[INDEXER_PATH_MAX];
+    IplImage* im_near = NULL;
+
+    /* reshape nearest image, black if it can not be decoded */
+    if (entry_path
+	(near_filename, sizeof(near_filename), ii->dirname,
+	 index_filename(ii, id)) == 0)
+      im_near = do_open(near_filename);
+    if (im_near != NULL)
+    {
+      do_reshape(im_near, im);
+      cvReleaseImage(&im_near);
+    }
+    else
+    {
+      memset(im->imageData, 0, im->imageSize);
+    }
+
+    tile_cache_ready(&ii->tiles, id);
+  }
+
+  *step = im->widthStep;
+  return (const unsigned char*)im->imageData;
+}
+
+static void index_put_tile(struct index_info* ii, unsigned int id)
+{
+  if (ii->has_atlas == 0) tile_cache_put(&ii->tiles, id);
+}
+
+static void blit_tile
+(
+ IplImage* im,
+ int x,
+ int y,
+ int npix,
+ const unsigned char* pix,
+ int step,
+ const struct resampler* rs
+)
+{
+  /* copy a tile to the cell x, y of im, of npix x npix pixels. */
+  /* tiles of another size are resampled with rs */
+
+  const uint64_t t = stats_start();
+  unsigned char* p = (unsigned char*)
+    (im->imageData + y * npix * im->widthStep + x * npix * 3);
+  int i;
+
+  if (npix != CONFIG_NPIX)
+  {
+    resampler_run_data(rs, pix, step, p, im->widthStep, 0, 0, npix, npix);
+  }
+  else
+  {
+    for (i = 0; i < CONFIG_NPIX; ++i, p += im->widthStep, pix += step)
+      memcpy(p, pix, CONFIG_NPIX * 3);
+  }
+
+  stats_stop(&stats.blit, t);
+}
+
+static unsigned int compute_dist
+(const unsigned char* a, const unsigned char* b)
+{
+  unsigned int d = 0;
+  unsigned int i;
+
+  for (i = 0; i < DESC_DIM; ++i)
+  {
+    const int diff = (a[i] - b[i]) / dist_w[i % 3];
+    d += diff * diff;
+  }
+
+  return d;
+}
+
+static inline unsigned int is_dist_unit(void)
+{
+  /* the vector kernel does not divide by the weights */
+  return (dist_w[0] == 1) && (dist_w[1] == 1) && (dist_w[2] == 1);
+}
+
+static inline void index_take
+(
+ const struct index_info* ii,
+ const struct pick_info* pi,
+ const unsigned char* desc,
+ unsigned int i,
+ unsigned int* best_dist,
+ unsigned int* best_i
+)
+{
+  /* scalar step of index_find, entry i against the current best */
+
+  unsigned int this_dist;
+
+  if (is_banned(pi, i)) return ;
+
+  this_dist = compute_dist(desc, ii->desc + i * DESC_STRIDE);
+  if (this_dist < *best_dist)
+  {
+    *best_dist = this_dist;
+    *best_i = i;
+  }
+}
+
+#ifdef __SSE2__
+
+static inline __m128i select_epi32(__m128i mask, __m128i a, __m128i b)
+{
+  /* a where mask is set, b elsewhere */
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* 16 bytes chunks per padded descriptor */
+#define DESC_NCHUNK ((DESC_STRIDE + 15) / 16)
+
+struct query_sse2
+{
+  /* query chunks as 16 bits integers, low and high halves */
+  __m128i lo[DESC_NCHUNK];
+  __m128i hi[DESC_NCHUNK];
+};
+
+static inline void query_sse2_init
+(struct query_sse2* q, const unsigned char* desc)
+{
+  /* 4 bytes descriptors are repeated to fill a chunk */
+
+  unsigned char buf[DESC_NCHUNK * 16];
+  unsigned int i;
+
+  for (i = 0; i < sizeof(buf); ++i)
+  {
+    const unsigned int k = (DESC_STRIDE == 4) ? (i % 4) : i;
+    buf[i] = (k < DESC_DIM) ? desc[k] : 0;
+  }
+
+  for (i = 0; i < DESC_NCHUNK; ++i)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_loadu_si128((const __m128i*)(buf + i * 16));
+    q->lo[i] = _mm_unpacklo_epi8(c, zero);
+    q->hi[i] = _mm_unpackhi_epi8(c, zero);
+  }
+}
+
+static inline __m128i dist4_sse2
+(const unsigned char* desc, const struct query_sse2* q)
+{
+  /* distances from q to the 4 consecutive descriptors at desc */
+
+  const __m128i zero = _mm_setzero_si128();
+
+#if (DESC_STRIDE == 4)
+
+  const __m128i e = _mm_loadu_si128((const __m128i*)desc);
+  __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(e, zero), q->lo[0]);
+  __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(e, zero), q->hi[0]);
+
+  /* squared differences, summed by pairs then by quadruplets */
+  lo = _mm_madd_epi16(lo, lo);
+  hi = _mm_madd_epi16(hi, hi);
+  return _mm_add_epi32
+  (
+   _mm_castps_si128(_mm_shuffle_ps
+    (_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0))),
+   _mm_castps_si128(_mm_shuffle_ps
+    (_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1)))
+  );
+
+#else
+
+  __m128i sum[4];
+  __m128i a;
+  __m128i b;
+  unsigned int i;
+  unsigned int j;
+
+  /* per descriptor partial sums, then transposed and added */
+  for (j = 0; j < 4; ++j)
+  {
+    sum[j] = zero;
+
+    for (i = 0; i < DESC_NCHUNK; ++i)
+    {
+      const __m128i e = _mm_loadu_si128
+	((const __m128i*)(desc + j * DESC_STRIDE + i * 16));
+      __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(e, zero), q->lo[i]);
+      __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(e, zero), q->hi[i]);
+      lo = _mm_madd_epi16(lo, lo);
+      hi = _mm_madd_epi16(hi, hi);
+      sum[j] = _mm_add_epi32(sum[j], _mm_add_epi32(lo, hi));
+    }
+  }
+
+  a = _mm_add_epi32
+    (_mm_unpacklo_epi32(sum[0], sum[1]), _mm_unpackhi_epi32(sum[0], sum[1]));
+  b = _mm_add_epi32
+    (_mm_unpacklo_epi32(sum[2], sum[3]), _mm_unpackhi_epi32(sum[2], sum[3]));
+  return _mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+
+#endif
+}
+
+static unsigned int index_find_sse2
+(
+ const struct index_info* ii,
+ const struct pick_info* pi,
+ const unsigned char* desc,
+ unsigned int i,
+ unsigned int n,
+ unsigned int* vec_dist
+)
+{
+  /* scan entries [i, n), n - i a multiple of 4, 4 entries per step */
+  /* penalized entries get an infinite distance. each lane keeps */
+  /* its first minimum, lanes are then reduced by distance then */
+  /* by position so that the result matches the scalar scan */
+
+  const __m128i inf = _mm_set1_epi32(0x7fffffff);
+  const __m128i four = _mm_set1_epi32(4);
+  const __m128i nquery = _mm_set1_epi32(pi->nquery);
+  struct query_sse2 q;
+  __m128i best_d = inf;
+  __m128i best_i = _mm_set1_epi32(-1);
+  __m128i pos = _mm_set_epi32(i + 3, i + 2, i + 1, i);
+  unsigned int d[4];
+  unsigned int k[4];
+  unsigned int best;
+  unsigned int j;
+
+  query_sse2_init(&q, desc);
+
+  for (; i != n; i += 4)
+  {
+    const __m128i b = _mm_loadu_si128((const __m128i*)(pi->ban + i));
+    __m128i dist = dist4_sse2(ii->desc + i * DESC_STRIDE, &q);
+    __m128i mask;
+
+    /* mask penalized entries */
+    mask = _mm_cmpgt_epi32(b, nquery);
+    dist = select_epi32(mask, inf, dist);
+
+    mask = _mm_cmplt_epi32(dist, best_d);
+    best_d = select_epi32(mask, dist, best_d);
+    best_i = select_epi32(mask, pos, best_i);
+    pos = _mm_add_epi32(pos, four);
+  }
+
+  _mm_storeu_si128((__m128i*)d, best_d);
+  _mm_storeu_si128((__m128i*)k, best_i);
+
+  best = 0;
+  for (j = 1; j < 4; ++j)
+  {
+    if ((d[j] < d[best]) || ((d[j] == d[best]) && (k[j] < k[best])))
+      best = j;
+  }
+
+  *vec_dist = d[best];
+  return k[best];
+}
+
+#endif /* __SSE2__ */
+
+/* k-d tree. exact nearest neighbor, same result as the scan */
+
+/* ranges up to this size are scanned */
+#define TREE_LEAF_SIZE 8
+
+struct index_tree
+{
+  /* implicit balanced tree over the entries 1 to n - 1, the first */
+  /* one being never penalized it is handled apart. the node of the */
+  /* range [lo, hi) is at mid = (lo + hi) / 2, its children ranges */
+  /* are [lo, mid) and [mid + 1, hi). entries with a lower value in */
+  /* the split dimension are on the left, higher on the right */
+  unsigned int n;
+  unsigned int* id;
+  /* descriptors copied in tree order */
+  unsigned char* desc;
+  unsigned char* dim;
+};
+
+static void tree_select
+(
+ const struct index_info* ii,
+ unsigned int* id,
+ unsigned int n,
+ unsigned int k,
+ unsigned int dim
+)
+{
+  /* partial sort id so that id[k] has the k-th smallest value */
+
+  unsigned int lo = 0;
+  unsigned int hi = n - 1;
+
+#define TREE_KEY(__i) ii->desc[id[__i] * DESC_STRIDE + dim]
+
+  while (lo < hi)
+  {
+    const unsigned char pivot = TREE_KEY((lo + hi) / 2);
+    unsigned int i = lo;
+    unsigned int j = hi;
+
+    while (i <= j)
+    {
+      unsigned int tmp;
+
+      while (TREE_KEY(i) < pivot) ++i;
+      while (TREE_KEY(j) > pivot) --j;
+      if (i > j) break ;
+
+      tmp = id[i];
+      id[i] = id[j];
+      id[j] = tmp;
+
+      ++i;
+      if (j-- == 0) break ;
+    }
+
+    if (k <= j) hi = j;
+    else if (k >= i) lo = i;
+    else break ;
+  }
+
+#undef TREE_KEY
+}
+
+static void tree_build
+(
+ const struct index_info* ii,
+ struct index_tree* it,
+ unsigned int lo,
+ unsigned int hi
+)
+{
+  unsigned char min[DESC_DIM];
+  unsigned char max[DESC_DIM];
+  unsigned int mid;
+  unsigned int dim;
+  unsigned int i;
+  unsigned int k;
+
+  if ((hi - lo) <= TREE_LEAF_SIZE) return ;
+
+  /* split along the largest spread */
+  for (k = 0; k < DESC_DIM; ++k)
+  {
+    min[k] = 0xff;
+    max[k] = 0;
+  }
+
+  for (i = lo; i < hi; ++i)
+  {
+    const unsigned char* const desc = ii->desc + it->id[i] * DESC_STRIDE;
+    for (k = 0; k < DESC_DIM; ++k)
+    {
+      if (desc[k] < min[k]) min[k] = desc[k];
+      if (desc[k] > max[k]) max[k] = desc[k];
+    }
+  }
+
+  dim = 0;
+  for (k = 1; k < DESC_DIM; ++k)
+    if ((max[k] - min[k]) > (max[dim] - min[dim])) dim = k;
+
+  mid = (lo + hi) / 2;
+  tree_select(ii, it->id + lo, hi - lo, mid - lo, dim);
+  it->dim[mid] = (unsigned char)dim;
+
+  tree_build(ii, it, lo, mid);
+  tree_build(ii, it, mid + 1, hi);
+}
+
+static struct index_tree* index_tree_create(const struct index_info* ii)
+{
+  struct index_tree* it;
+  unsigned int i;
+
+  it = malloc(sizeof(struct index_tree));
+  it->n = ii->n - 1;
+  it->id = malloc((it->n + 1) * sizeof(unsigned int));
+  it->desc = malloc((it->n + 1) * DESC_STRIDE);
+  it->dim = calloc(it->n + 1, 1);
+
+  for (i = 0; i < it->n; ++i) it->id[i] = i + 1;
+
+  tree_build(ii, it, 0, it->n);
+
+  for (i = 0; i < it->n; ++i)
+  {
+    unsigned char* const dst = it->desc + i * DESC_STRIDE;
+    memcpy(dst, ii->desc + it->id[i] * DESC_STRIDE, DESC_STRIDE);
+  }
+
+  return it;
+}
+
+static void index_tree_free(struct index_tree* it)
+{
+  free(it->id);
+  free(it->desc);
+  free(it->dim);
+  free(it);
+}
+
+static inline void tree_take
+(
+ const struct index_info* ii,
+ const struct pick_info* pi,
+ const unsigned char* desc,
+ unsigned int pos,
+ unsigned int* best_dist,
+ unsigned int* best_i
+)
+{
+  /* ties go to the lowest id, as with the scan */
+
+  const struct index_tree* const it = ii->tree;
+  const unsigned int id = it->id[pos];
+  unsigned int this_dist;
+
+  if (is_banned(pi, id)) return ;
+
+  this_dist = compute_dist(desc, it->desc + pos * DESC_STRIDE);
+  if ((this_dist < *best_dist) ||
+      ((this_dist == *best_dist) && (id < *best_i)))
+  {
+    *best_dist = this_dist;
+    *best_i = id;
+  }
+}
+
+static void tree_search
+(
+ const struct index_info* ii,
+ const struct pick_info* pi,
+ const unsigned char* desc,
+ unsigned int lo,
+ unsigned int hi,
+ unsigned int* best_dist,
+ unsigned int* best_i,
+ unsigned int* nscan
+)
+{
+  /* penalized nodes still split the space but are not candidates */
+  /* the far side is visited unless it can only hold strictly */
+  /* farther entries, equally far ones may have a lower id */
+
+  const struct index_tree* const it = ii->tree;
+  unsigned int mid;
+  unsigned int dim;
+  unsigned int bound;
+  int diff;
+
+  if ((hi - lo) <= TREE_LEAF_SIZE)
+  {
+    *nscan += hi - lo;
+    for (; lo < hi; ++lo) tree_take(ii, pi, desc, lo, best_dist, best_i);
+    return ;
+  }
+
+  mid = (lo + hi) / 2;
+  ++*nscan;
+  tree_take(ii, pi, desc, mid, best_dist, best_i);
+
+  dim = it->dim[mid];
+  diff = desc[dim] - it->desc[mid * DESC_STRIDE + dim];
+
+  /* the weighted distance only grows with the difference */
+  bound = (unsigned int)(abs(diff) / dist_w[dim % 3]);
+  bound *= bound;
+
+  if (diff < 0)
+  {
+    tree_search(ii, pi, desc, lo, mid, best_dist, best_i, nscan);
+    if (bound <= *best_dist)
+      tree_search(ii, pi, desc, mid + 1, hi, best_dist, best_i, nscan);
+  }
+  else
+  {
+    tree_search(ii, pi, desc, mid + 1, hi, best_dist, best_i, nscan);
+    if (bound <= *best_dist)
+      tree_search(ii, pi, desc, lo, mid, best_dist, best_i, nscan);
+  }
+}
+
+/* quantized searches, see index_pq */
+struct knn_info;
+static unsigned int index_find_pq
+(
+ const struct index_info*,
+ const struct pick_info*,
+ const unsigned char*,
+ unsigned int*
+);
+static void index_find_knn_pq
+(const struct index_info*, const unsigned char*, struct knn_info*);
+
+static unsigned int index_find
+(
+ const struct index_info* ii,
+ struct pick_info* pi,
+ const unsigned char* rgb,
+ const unsigned char* desc
+)
+{
+  /* nearest entry of desc not banned by pi, then banned */
+
+  unsigned int best_dist;
+  unsigned int best_i;
+  unsigned int nscan;
+  unsigned int i;
+
+  /* the first entry is never penalized */
+  best_dist = compute_dist(desc, index_desc(ii, 0));
+  best_i = 0;
+  nscan = ii->n;
+  i = 1;
+
+  if (ii->pq != NULL)
+  {
+    best_i = index_find_pq(ii, pi, desc, &nscan);
+    i = ii->n;
+  }
+  else if (ii->tree != NULL)
+  {
+    nscan = 1;
+    tree_search(ii, pi, desc, 0, ii->tree->n, &best_dist, &best_i, &nscan);
+    i = ii->n;
+  }
+
+#ifdef __SSE2__
+  if ((i < ii->n) && is_dist_unit())
+  {
+    /* scalar up to a multiple of 4, vector then scalar tail */
+    const unsigned int n = ii->n & ~3;
+
+    for (; (i < 4) && (i < ii->n); ++i)
+      index_take(ii, pi, desc, i, &best_dist, &best_i);
+
+    if (i < n)
+    {
+      unsigned int vec_dist;
+      const unsigned int vec_i =
+	index_find_sse2(ii, pi, desc, i, n, &vec_dist);
+      if (vec_dist < best_dist)
+      {
+	best_dist = vec_dist;
+	best_i = vec_i;
+      }
+      i = n;
+    }
+  }
+#endif
+
+  for (; i < ii->n; ++i)
+    index_take(ii, pi, desc, i, &best_dist, &best_i);
+
+  pick_take(pi, best_i);
+
+  stats_add(&stats.nquery, 1);
+  stats_add(&stats.nscan, nscan);
+
+  return best_i;
+}
+
+/* k nearest neighbors, regardless of the penalties */
+
+struct knn_info
+{
+  /* the n <= k best entries, sorted by distance then by id */
+  unsigned int k;
+  unsigned int n;
+  unsigned int* id;
+  unsigned int* dist;
+  /* distances computed by the last query */
+  unsigned int nscan;
+};
+
+static inline unsigned int knn_bound(const struct knn_info* ki)
+{
+  /* entries farther than this can not enter the list */
+  if (ki->n < ki->k) return (unsigned int)-1;
+  return ki->dist[ki->n - 1];
+}
+
+static inline void knn_add
+(struct knn_info* ki, unsigned int id, unsigned int dist)
+{
+  unsigned int i;
+
+  if (ki->n == ki->k)
+  {
+    const unsigned int last = ki->n - 1;
+    if (dist > ki->dist[last]) return ;
+    if ((dist == ki->dist[last]) && (id > ki->id[last])) return ;
+    --ki->n;
+  }
+
+  for (i = ki->n++; i; --i)
+  {
+    if (ki->dist[i - 1] < dist) break ;
+    if ((ki->dist[i - 1] == dist) && (ki->id[i - 1] < id)) break ;
+    ki->dist[i] = ki->dist[i - 1];
+    ki->id[i] = ki->id[i - 1];
+  }
+
+  ki->dist[i] = dist;
+  ki->id[i] = id;
+}
+
+static void tree_search_knn
+(
+ const struct index_info* ii,
+ const unsigned char* desc,
+ unsigned int lo,
+ unsigned int hi,
+ struct knn_info* ki
+)
+{
+  const struct index_tree* const it = ii->tree;
+  unsigned int mid;
+  unsigned int dim;
+  unsigned int bound;
+  int diff;
+
+  if ((hi - lo) <= TREE_LEAF_SIZE)
+  {
+    ki->nscan += hi - lo;
+    for (; lo < hi; ++lo)
+      knn_add(ki, it->id[lo], compute_dist(desc, it->desc + lo * DESC_STRIDE));
+    return ;
+  }
+
+  mid = (lo + hi) / 2;
+  ++ki->nscan;
+  knn_add(ki, it->id[mid], compute_dist(desc, it->desc + mid * DESC_STRIDE));
+
+  dim = it->dim[mid];
+  diff = desc[dim] - it->desc[mid * DESC_STRIDE + dim];
+  bound = (unsigned int)(abs(diff) / dist_w[dim % 3]);
+  bound *= bound;
+
+  if (diff < 0)
+  {
+    tree_search_knn(ii, desc, lo, mid, ki);
+    if (bound <= knn_bound(ki)) tree_search_knn(ii, desc, mid + 1, hi, ki);
+  }
+  else
+  {
+    tree_search_knn(ii, desc, mid + 1, hi, ki);
+    if (bound <= knn_bound(ki)) tree_search_knn(ii, desc, lo, mid, ki);
+  }
+}
+
+static void index_find_knn
+(const struct index_info* ii, const unsigned char* desc, struct knn_info* ki)
+{
+  /* does not modify the index, safe to call from several threads */
+
+  unsigned int i = 0;
+
+  if (ii->pq != NULL)
+  {
+    index_find_knn_pq(ii, desc, ki);
+    return ;
+  }
+
+  ki->n = 0;
+
+  if (ii->tree != NULL)
+  {
+    ki->nscan = 1;
+    knn_add(ki, 0, compute_dist(desc, index_desc(ii, 0)));
+    tree_search_knn(ii, desc, 0, ii->tree->n, ki);
+    return ;
+  }
+
+  ki->nscan = ii->n;
+
+#ifdef __SSE2__
+  if (is_dist_unit())
+  {
+    struct query_sse2 q;
+    unsigned int d[4];
+    unsigned int j;
+
+    query_sse2_init(&q, desc);
+
+    for (; (i + 4) <= ii->n; i += 4)
+    {
+      const unsigned int bound = knn_bound(ki);
+      const __m128i dist = dist4_sse2(ii->desc + i * DESC_STRIDE, &q);
+      _mm_storeu_si128((__m128i*)d, dist);
+      for (j = 0; j < 4; ++j)
+	if (d[j] <= bound) knn_add(ki, i + j, d[j]);
+    }
+  }
+#endif
+
+  for (; i < ii->n; ++i)
+    knn_add(ki, i, compute_dist(desc, ii->desc + i * DESC_STRIDE));
+}
+
+/* product quantizer. the y cr cb means of each sub cell are coded */
+/* as the nearest of PQ_NCENT centroids, an entry takes DESC_NCELL */
+/* bytes. a query computes its distance to all the centroids once */
+/* then the distance to a code is the sum of DESC_NCELL lookups. */
+/* the best codes are reranked with the exact descriptors, read */
+/* from the index file, so that they are not kept in memory */
+
+#define PQ_NCENT 256
+/* k-means training, on a subset of the entries */
+#define PQ_NSAMPLE 32768
+#define PQ_NITER 8
+/* codes reranked per wanted entry, and at least */
+#define PQ_RERANK 8
+#define PQ_MIN_RERANK 64
+/* entries coded per work item */
+#define PQ_CHUNK 4096
+
+struct index_pq
+{
+  unsigned char cent[DESC_NCELL][PQ_NCENT][3];
+  /* n x DESC_NCELL codes */
+  unsigned char* codes;
+
+  /* creation only */
+  const struct index_info* ii;
+  unsigned int pos;
+};
+
+static inline unsigned int pq_nearest
+(const unsigned char cent[PQ_NCENT][3], const unsigned char* x)
+{
+  unsigned int best_dist = (unsigned int)-1;
+  unsigned int best_c = 0;
+  unsigned int c;
+
+  for (c = 0; c < PQ_NCENT; ++c)
+  {
+    const int d0 = x[0] - cent[c][0];
+    const int d1 = x[1] - cent[c][1];
+    const int d2 = x[2] - cent[c][2];
+    const unsigned int d = d0 * d0 + d1 * d1 + d2 * d2;
+    if (d < best_dist)
+    {
+      best_dist = d;
+      best_c = c;
+    }
+  }
+
+  return best_c;
+}
+
+static void* pq_train_main(void* param)
+{
+  /* worker, k-means of the sub cells claimed */
+
+  struct index_pq* const pq = param;
+  const struct index_info* const ii = pq->ii;
+  const unsigned int ns = ii->n < PQ_NSAMPLE ? ii->n : PQ_NSAMPLE;
+  unsigned int (*sum)[4] = malloc(PQ_NCENT * sizeof(*sum));
+  unsigned char* const x = malloc(ns * 3);
+  unsigned int m;
+  unsigned int i;
+  unsigned int c;
+  unsigned int k;
+  unsigned int iter;
+
+  while ((m = __sync_fetch_and_add(&pq->pos, 1)) < DESC_NCELL)
+  {
+    unsigned char (*const cent)[3] = pq->cent[m];
+
+    /* evenly spaced samples, the first ones as initial centroids */
+    for (i = 0; i < ns; ++i)
+    {
+      const unsigned int id = (unsigned int)(((uint64_t)i * ii->n) / ns);
+      memcpy(x + i * 3, index_desc(ii, id) + m * 3, 3);
+    }
+
+    for (c = 0; c < PQ_NCENT; ++c)
+      memcpy(cent[c], x + ((c * ns) / PQ_NCENT) * 3, 3);
+
+    for (iter = 0; iter < PQ_NITER; ++iter)
+    {
+      memset(sum, 0, PQ_NCENT * sizeof(*sum));
+
+      for (i = 0; i < ns; ++i)
+      {
+	c = pq_nearest(cent, x + i * 3);
+	for (k = 0; k < 3; ++k) sum[c][k] += x[i * 3 + k];
+	++sum[c][3];
+      }
+
+      /* an empty cluster keeps its centroid */
+      for (c = 0; c < PQ_NCENT; ++c)
+      {
+	if (sum[c][3] == 0) continue ;
+	for (k = 0; k < 3; ++k)
+	  cent[c][k] = (sum[c][k] + sum[c][3] / 2) / sum[c][3];
+      }
+    }
+  }
+
+  free(x);
+  free(sum);
+
+  return NULL;
+}
+
+static void* pq_code_main(void* param)
+{
+  /* worker, code the chunks of entries claimed */
+
+  struct index_pq* const pq = param;
+  const struct index_info* const ii = pq->ii;
+  unsigned int i;
+  unsigned int m;
+
+  while ((i = __sync_fetch_and_add(&pq->pos, PQ_CHUNK)) < ii->n)
+  {
+    const unsigned int hi = (ii->n - i) < PQ_CHUNK ? ii->n : i + PQ_CHUNK;
+
+    for (; i < hi; ++i)
+    {
+      const unsigned char* const desc = index_desc(ii, i);
+      unsigned char* const code = pq->codes + i * DESC_NCELL;
+      for (m = 0; m < DESC_NCELL; ++m)
+	code[m] = pq_nearest(pq->cent[m], desc + m * 3);
+    }
+  }
+
+  return NULL;
+}
+
+static struct index_pq* index_pq_create
+(struct index_info* ii, unsigned int nthread)
+{
+  /* train and code. the in memory descriptors of an index loaded */
+  /* from a file are released, reranking reads the file instead */
+
+  struct index_pq* const pq = malloc(sizeof(struct index_pq));
+  pthread_t* threads;
+  unsigned int i;
+  unsigned int pass;
+
+  pq->ii = ii;
+  pq->codes = malloc((size_t)ii->n * DESC_NCELL);
+
+  nthread = get_nthread(nthread);
+  threads = malloc(nthread * sizeof(pthread_t));
+
+  for (pass = 0; pass < 2; ++pass)
+  {
+    pq->pos = 0;
+    for (i = 0; i < nthread; ++i)
+    {
+      pthread_create
+	(&threads[i], NULL, pass ? pq_code_main : pq_train_main, pq);
+    }
+    for (i = 0; i < nthread; ++i)
+      pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+
+  if (ii->map.addr != NULL)
+  {
+    free(ii->desc);
+    ii->desc = NULL;
+  }
+
+  printf("[ index_pq ] %u entries, %u code bytes each\n",
+	 ii->n, (unsigned int)DESC_NCELL);
+
+  return pq;
+}
+
+static void index_pq_free(struct index_pq* pq)
+{
+  free(pq->codes);
+  free(pq);
+}
+
+static void pq_table
+(const struct index_pq* pq, const unsigned char* desc, unsigned int* table)
+{
+  /* weighted distances of the query sub cells to the centroids */
+
+  unsigned int m;
+  unsigned int c;
+  unsigned int k;
+
+  for (m = 0; m < DESC_NCELL; ++m)
+  {
+    for (c = 0; c < PQ_NCENT; ++c)
+    {
+      unsigned int d = 0;
+      for (k = 0; k < 3; ++k)
+      {
+	const int diff = (desc[m * 3 + k] - pq->cent[m][c][k]) / dist_w[k];
+	d += diff * diff;
+      }
+      table[m * PQ_NCENT + c] = d;
+    }
+  }
+}
+
+static inline unsigned int pq_dist
+(const unsigned int* table, const unsigned char* code)
+{
+  unsigned int d = 0;
+  unsigned int m;
+
+  for (m = 0; m < DESC_NCELL; ++m) d += table[m * PQ_NCENT + code[m]];
+
+  return d;
+}
+
+static unsigned int pq_nrerank(const struct index_info* ii, unsigned int k)
+{
+  unsigned int n = k * PQ_RERANK;
+  if (n < PQ_MIN_RERANK) n = PQ_MIN_RERANK;
+  if (n > ii->n) n = ii->n;
+  return n;
+}
+
+static unsigned int index_find_pq
+(
+ const struct index_info* ii,
+ const struct pick_info* pi,
+ const unsigned char* desc,
+ unsigned int* nscan
+)
+{
+  /* the nearest non penalized entry among the best codes */
+
+  const struct index_pq* const pq = ii->pq;
+  unsigned int table[DESC_NCELL * PQ_NCENT];
+  struct knn_info ci;
+  unsigned int best_dist = (unsigned int)-1;
+  unsigned int best_i = 0;
+  unsigned int i;
+
+  ci.k = pq_nrerank(ii, 1);
+  ci.n = 0;
+  ci.id = malloc(ci.k * sizeof(unsigned int));
+  ci.dist = malloc(ci.k * sizeof(unsigned int));
+
+  pq_table(pq, desc, table);
+
+  /* the first entry is never penalized */
+  for (i = 0; i < ii->n; ++i)
+  {
+    unsigned int d;
+    if (i && is_banned(pi, i)) continue ;
+    d = pq_dist(table, pq->codes + i * DESC_NCELL);
+    if (d <= knn_bound(&ci)) knn_add(&ci, i, d);
+  }
+
+  for (i = 0; i < ci.n; ++i)
+  {
+    const unsigned int id = ci.id[i];
+    const unsigned int d = compute_dist(desc, index_desc(ii, id));
+    if ((d < best_dist) || ((d == best_dist) && (id < best_i)))
+    {
+      best_dist = d;
+      best_i = id;
+    }
+  }
+
+  *nscan = ii->n + ci.n;
+
+  free(ci.id);
+  free(ci.dist);
+
+  return best_i;
+}
+
+static void index_find_knn_pq
+(const struct index_info* ii, const unsigned char* desc, struct knn_info* ki)
+{
+  /* the k nearest among the PQ_RERANK * k best codes */
+
+  const struct index_pq* const pq = ii->pq;
+  unsigned int table[DESC_NCELL * PQ_NCENT];
+  struct knn_info ci;
+  unsigned int i;
+
+  ci.k = pq_nrerank(ii, ki->k);
+  ci.n = 0;
+  ci.id = malloc(ci.k * sizeof(unsigned int));
+  ci.dist = malloc(ci.k * sizeof(unsigned int));
+
+  pq_table(pq, desc, table);
+
+  for (i = 0; i < ii->n; ++i)
+  {
+    const unsigned int d = pq_dist(table, pq->codes + i * DESC_NCELL);
+    if (d <= knn_bound(&ci)) knn_add(&ci, i, d);
+  }
+
+  ki->n = 0;
+  for (i = 0; i < ci.n; ++i)
+    knn_add(ki, ci.id[i], compute_dist(desc, index_desc(ii, ci.id[i])));
+
+  ki->nscan = ii->n + ci.n;
+
+  free(ci.id);
+  free(ci.dist);
+}
+
+static unsigned int index_pick
+(
+ const struct index_info* ii,
+ struct pick_info* pi,
+ const unsigned int* cand,
+ unsigned int ncand,
+ const unsigned char* desc
+)
+{
+  /* same as index_find, given the nearest entries of desc sorted */
+  /* by distance then id. the first one not penalized is the one */
+  /* index_find would return. only if they all are is the index */
+  /* searched again, which can not happen with at least as many */
+  /* candidates as penalized entries */
+
+  unsigned int i;
+
+  for (i = 0; i < ncand; ++i)
+  {
+    const unsigned int id = cand[i];
+    if ((id == 0) || (is_banned(pi, id) == 0))
+    {
+      pick_take(pi, id);
+      return id;
+    }
+  }
+
+  return index_find(ii, pi, NULL, desc);
+}
+
+
+/* tiler */
+
+struct mozaic_info
+{
+  /* entry identifiers, h x w */
+  unsigned int* tile_arr;
+  int h;
+  int w;
+  /* rendered pixels per cell side */
+  int npix;
+  IplImage* tile_im;
+  /* cell descriptors, h x w x DESC_STRIDE bytes */
+  unsigned char* desc;
+};
+
+/* summed area table of a bgr image, sum[y][x] the channel sums of */
+/* the pixels above and left of x, y. sums wrap around, differences */
+/* stay exact as long as a region sum fits in 32 bits */
+
+struct sat_info
+{
+  int w;
+  int h;
+  /* (h + 1) x (w + 1) x 3 */
+  uint32_t* sum;
+};
+
+static void sat_create(struct sat_info* sat, const IplImage* im)
+{
+  const unsigned int stride = (im->width + 1) * 3;
+  uint32_t* row;
+  int x;
+  int y;
+
+  sat->w = im->width;
+  sat->h = im->height;
+  sat->sum = malloc((size_t)stride * (im->height + 1) * sizeof(uint32_t));
+
+  memset(sat->sum, 0, stride * sizeof(uint32_t));
+
+  for (y = 0, row = sat->sum + stride; y < im->height; ++y, row += stride)
+  {
+    const unsigned char* p = (const unsigned char*)
+      (im->imageData + y * im->widthStep);
+    const uint32_t* const above = row - stride;
+    uint32_t r[3] = { 0, 0, 0 };
+
+    row[0] = 0;
+    row[1] = 0;
+    row[2] = 0;
+
+    for (x = 3; x < (int)stride; x += 3, p += 3)
+    {
+      r[0] += p[0];
+      r[1] += p[1];
+      r[2] += p[2];
+      row[x + 0] = above[x + 0] + r[0];
+      row[x + 1] = above[x + 1] + r[1];
+      row[x + 2] = above[x + 2] + r[2];
+    }
+  }
+}
+
+static void sat_free(struct sat_info* sat)
+{
+  free(sat->sum);
+}
+
+static inline void sat_sum
+(const struct sat_info* sat, int x0, int y0, int x1, int y1, uint32_t* sum)
+{
+  /* channel sums of the pixels x0, y0 to x1 - 1, y1 - 1 */
+
+  const unsigned int stride = (sat->w + 1) * 3;
+  const uint32_t* const a = sat->sum + y0 * stride + x0 * 3;
+  const uint32_t* const b = sat->sum + y0 * stride + x1 * 3;
+  const uint32_t* const c = sat->sum + y1 * stride + x0 * 3;
+  const uint32_t* const d = sat->sum + y1 * stride + x1 * 3;
+
+  sum[0] = d[0] - b[0] - c[0] + a[0];
+  sum[1] = d[1] - b[1] - c[1] + a[1];
+  sum[2] = d[2] - b[2] - c[2] + a[2];
+}
+
+static void cell_desc
+(
+ const struct sat_info* sat,
+ int x0,
+ int y0,
+ int w,
+ int h,
+ unsigned char* desc
+)
+{
+  /* descriptor of the w x h region at x0, y0. the bgr means of the */
+  /* sub cells are converted to ycc, as binning then cvCvtColor */
+
+  int xbounds[CONFIG_NGRID + 1];
+  int ybounds[CONFIG_NGRID + 1];
+  unsigned char bgr[3];
+  uint32_t sum[DESC_NCELL][3];
+  uint64_t npix[DESC_NCELL];
+  uint64_t all_sum[3] = { 0, 0, 0 };
+  uint64_t all_npix = 0;
+  int gx;
+  int gy;
+  int k;
+
+  for (k = 0; k <= CONFIG_NGRID; ++k)
+  {
+    xbounds[k] = x0 + (k * w + CONFIG_NGRID - 1) / CONFIG_NGRID;
+    ybounds[k] = y0 + (k * h + CONFIG_NGRID - 1) / CONFIG_NGRID;
+  }
+
+  for (gy = 0; gy < CONFIG_NGRID; ++gy)
+  {
+    for (gx = 0; gx < CONFIG_NGRID; ++gx)
+    {
+      const int cell = gy * CONFIG_NGRID + gx;
+
+      sat_sum
+	(sat, xbounds[gx], ybounds[gy], xbounds[gx + 1], ybounds[gy + 1],
+	 sum[cell]);
+
+      npix[cell] = (uint64_t)(xbounds[gx + 1] - xbounds[gx]) *
+	(uint64_t)(ybounds[gy + 1] - ybounds[gy]);
+
+      for (k = 0; k < 3; ++k) all_sum[k] += sum[cell][k];
+      all_npix += npix[cell];
+    }
+  }
+
+  /* regions smaller than the grid leave sub cells empty */
+  for (k = 0; k < DESC_NCELL; ++k)
+  {
+    if (npix[k])
+    {
+      bgr[0] = sum[k][0] / npix[k];
+      bgr[1] = sum[k][1] / npix[k];
+      bgr[2] = sum[k][2] / npix[k];
+    }
+    else
+    {
+      bgr[0] = all_sum[0] / all_npix;
+      bgr[1] = all_sum[1] / all_npix;
+      bgr[2] = all_sum[2] / all_npix;
+    }
+
+    bgr_to_ycc_pixel(bgr, desc + k * 3);
+  }
+
+  memset(desc + DESC_DIM, 0, DESC_STRIDE - DESC_DIM);
+}
+
+/* cell layout over the target image, cell x, y covers the pixels */
+/* x * s to (x + 1) * s - 1, and the same vertically */
+struct grid_info
+{
+  int s;
+  int w;
+  int h;
+};
+
+static int grid_from_ntil(struct grid_info* g, int w, int h, int ntil)
+{
+  /* square cells, ntil along the largest side. the last partial */
+  /* row and column of cells are left out */
+
+  const int largest = w > h ? w : h;
+  int s;
+
+  if (ntil <= 0) return -1;
+
+  s = largest / ntil;
+  if (s == 0) s = 1;
+
+  g->s = s;
+  g->w = w / s - ((w % s) ? 1 : 0);
+  g->h = h / s - ((h % s) ? 1 : 0);
+
+  return 0;
+}
+
+struct tiler_info
+{
+  const struct index_info* ii;
+
+  /* target image and cell layout */
+  const struct sat_info* sat;
+  const struct grid_info* grid;
+
+  /* cell descriptors, DESC_STRIDE bytes per cell */
+  unsigned char* desc;
+
+  /* nearest entries of each cell, ncand per cell, nfound valid */
+  unsigned int ncand;
+  unsigned int* cand;
+  unsigned int* nfound;
+
+  /* next row to process */
+  unsigned int pos;
+};
+
+static void* tiler_main(void* param)
+{
+  /* worker, describe the cells and find their candidates */
+  /* row by row */
+
+  struct tiler_info* const ti = param;
+  const struct grid_info* const g = ti->grid;
+  struct knn_info ki;
+  uint64_t nscan;
+  uint64_t t;
+  unsigned int y;
+  int x;
+
+  ki.k = ti->ncand;
+  ki.dist = malloc(ki.k * sizeof(unsigned int));
+
+  while ((y = __sync_fetch_and_add(&ti->pos, 1)) < (unsigned int)g->h)
+  {
+    t = stats_start();
+    nscan = 0;
+
+    for (x = 0; x < g->w; ++x)
+    {
+      const unsigned int i = y * g->w + x;
+      unsigned char* const desc = ti->desc + i * DESC_STRIDE;
+
+      cell_desc
+	(ti->sat, x * g->s, y * g->s, g->s, g->s, desc);
+
+      ki.id = ti->cand + i * ti->ncand;
+      index_find_knn(ti->ii, desc, &ki);
+      ti->nfound[i] = ki.n;
+      nscan += ki.nscan;
+    }
+
+    stats_add(&stats.nquery, g->w);
+    stats_add(&stats.nscan, nscan);
+    stats_stop(&stats.match, t);
+  }
+
+  free(ki.dist);
+
+  return NULL;
+}
+
+static void tile_cells(struct tiler_info* ti, unsigned int nthread)
+{
+  /* fill ti->desc and the candidates of all the cells of ti->grid */
+
+  pthread_t* threads;
+  unsigned int i;
+
+  ti->pos = 0;
+
+  nthread = get_nthread(nthread);
+  threads = malloc(nthread * sizeof(pthread_t));
+  for (i = 0; i < nthread; ++i)
+    pthread_create(&threads[i], NULL, tiler_main, ti);
+  for (i = 0; i < nthread; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+static int do_tile
+(
+ const char* im_filename,
+ const struct index_info* ii,
+ struct mozaic_info* mi,
+ int ntil,
+ unsigned int nthread
+)
+{
+  /* cells are matched in 2 passes. worker threads first find the */
+  /* nearest entries of every cell, without looking at penalties */
+  /* then the cells are assigned in raster order, each taking its */
+  /* first candidate not penalized. this is what the sequential */
+  /* search would choose, the mosaic does not depend on nthread */
+  /* ntil tiles along the largest side. the repetition state is */
+  /* local, ii is only read */
+
+  struct tiler_info ti;
+  struct pick_info pi;
+  struct sat_info sat;
+  struct grid_info grid;
+  IplImage* im_ini;
+  uint64_t t;
+  int x;
+  int y;
+  unsigned int i;
+
+  im_ini = do_open(im_filename);
+  if (im_ini == NULL)
+  {
+    printf("cannot open %s\n", im_filename);
+    return -1;
+  }
+
+  if (grid_from_ntil(&grid, im_ini->width, im_ini->height, ntil))
+  {
+    printf("invalid tile count %d\n", ntil);
+    cvReleaseImage(&im_ini);
+    return -1;
+  }
+
+  sat_create(&sat, im_ini);
+  cvReleaseImage(&im_ini);
+
+  pick_init(&pi, ii, ntil);
+
+  /* prepare resulting array */
+  mi->w = grid.w;
+  mi->h = grid.h;
+  mi->tile_arr = malloc(mi->w * mi->h * sizeof(unsigned int));
+  mi->desc = malloc(mi->w * mi->h * DESC_STRIDE);
+
+  printf("[ do_tile ]\n");
+
+  /* at most pi.penalty - 1 entries are penalized at once */
+  ti.ii = ii;
+  ti.sat = &sat;
+  ti.grid = &grid;
+  ti.desc = mi->desc;
+  ti.ncand = pi.penalty < ii->n ? pi.penalty : ii->n;
+  ti.cand = malloc(mi->w * mi->h * ti.ncand * sizeof(unsigned int));
+  ti.nfound = malloc(mi->w * mi->h * sizeof(unsigned int));
+
+  tile_cells(&ti, nthread);
+
+  t = stats_start();
+
+  for (y = 0; y < mi->h; ++y)
+  {
+    for (x = 0; x < mi->w; ++x)
+    {
+      i = y * mi->w + x;
+
+      /* find nearest indexed image */
+      mi->tile_arr[i] = index_pick
+	(ii, &pi, ti.cand + i * ti.ncand, ti.nfound[i],
+	 mi->desc + i * DESC_STRIDE);
+    }
+  }
+
+  stats_stop(&stats.match, t);
+
+  free(ti.cand);
+  free(ti.nfound);
+  pick_fini(&pi);
+
+  sat_free(&sat);
+
+  return 0;
+}
+
+static void do_sweep
+(
+ const char* im_filename,
+ const struct index_info* ii,
+ int ntil_lo,
+ int ntil_hi,
+ unsigned int nthread
+)
+{
+  /* report the grid and the mean distance to the nearest entry, */
+  /* without repetition penalty, for tile counts ntil_lo to ntil_hi */
+  /* the target is read and summed once for all the grids */
+
+  struct tiler_info ti;
+  struct sat_info sat;
+  struct grid_info grid;
+  IplImage* im_ini;
+  int ntil;
+
+  im_ini = do_open(im_filename);
+  if (im_ini == NULL) return ;
+  sat_create(&sat, im_ini);
+
+  ti.ii = ii;
+  ti.sat = &sat;
+  ti.grid = &grid;
+  ti.ncand = 1;
+
+  printf("[ do_sweep ] %d x %d\n", im_ini->width, im_ini->height);
+
+  for (ntil = ntil_lo; ntil <= ntil_hi; ++ntil)
+  {
+    unsigned int ncell;
+    uint64_t sum = 0;
+    unsigned int i;
+
+    if (grid_from_ntil(&grid, im_ini->width, im_ini->height, ntil))
+      continue ;
+    ncell = grid.w * grid.h;
+    if (ncell == 0) continue ;
+
+    ti.desc = malloc(ncell * DESC_STRIDE);
+    ti.cand = malloc(ncell * sizeof(unsigned int));
+    ti.nfound = malloc(ncell * sizeof(unsigned int));
+
+    tile_cells(&ti, nthread);
+
+    for (i = 0; i < ncell; ++i)
+    {
+      const unsigned char* const a = ti.desc + i * DESC_STRIDE;
+      const unsigned char* const b = index_desc(ii, ti.cand[i]);
+      sum += compute_dist(a, b);
+    }
+
+    printf("ntil %d cell %d grid %d x %d out %d x %d dist %.2f\n",
+	   ntil, grid.s, grid.w, grid.h,
+	   grid.w * CONFIG_NPIX, grid.h * CONFIG_NPIX,
+	   (double)sum / (double)ncell);
+
+    free(ti.desc);
+    free(ti.cand);
+    free(ti.nfound);
+  }
+
+  sat_free(&sat);
+  cvReleaseImage(&im_ini);
+}
+
+
+/* image writers. images are written one strip of rows at a time */
+/* as uncompressed rgb, either binary ppm or baseline tiff with one */
+/* tiff strip per written strip, so that the whole image is never */
+/* held in memory */
+
+#define STRIP_PPM 0
+#define STRIP_TIFF 1
+
+struct strip_writer
+{
+  int fd;
+  unsigned int type;
+  unsigned int width;
+  unsigned int height;
+};
+
+static unsigned char* tiff_entry
+(
+ unsigned char* p,
+ uint16_t tag,
+ uint16_t type,
+ uint32_t count,
+ uint32_t value
+)
+{
+  /* ifd entry in host byte order, short values are left justified */
+
+  const uint16_t short_value = (uint16_t)value;
+
+  memcpy(p + 0, &tag, 2);
+  memcpy(p + 2, &type, 2);
+  memcpy(p + 4, &count, 4);
+  memset(p + 8, 0, 4);
+  if ((type == 3) && (count == 1)) memcpy(p + 8, &short_value, 2);
+  else memcpy(p + 8, &value, 4);
+
+  return p + 12;
+}
+
+static int strip_writer_tiff_header
+(struct strip_writer* sw, unsigned int strip_height)
+{
+  /* header, ifd, bits per sample, resolutions, strip offsets and */
+  /* byte counts are written first. strips then follow in order */
+
+  const uint16_t one = 1;
+  const uint32_t row_size = sw->width * 3;
+  const uint32_t nstrip = (sw->height + strip_height - 1) / strip_height;
+  const uint32_t bits_off = 8 + 2 + 13 * 12 + 4;
+  const uint32_t res_off = bits_off + 3 * 2;
+  const uint32_t offs_off = res_off + 2 * 8;
+  const uint32_t counts_off = offs_off + nstrip * 4;
+  const uint32_t data_off = counts_off + nstrip * 4;
+  const uint16_t nentry = 13;
+  const uint16_t bits = 8;
+  const uint32_t res[2] = { CONFIG_DPI, 1 };
+  const uint32_t ifd_off = 8;
+  const uint32_t next_ifd = 0;
+  const uint16_t magic = 42;
+  unsigned char* buf;
+  unsigned char* p;
+  uint32_t off;
+  uint32_t i;
+  int err = -1;
+
+  /* classic tiff offsets are 32 bits */
+  if (((uint64_t)data_off + (uint64_t)row_size * sw->height) >= 0xffffffffUL)
+    return -1;
+
+  buf = malloc(data_off);
+  p = buf;
+
+  /* header, byte order of the host */
+  memcpy(p, (*(const unsigned char*)&one) ? "II" : "MM", 2);
+  memcpy(p + 2, &magic, 2);
+  memcpy(p + 4, &ifd_off, 4);
+  p += 8;
+
+  /* ifd, entries sorted by tag */
+  memcpy(p, &nentry, 2);
+  p += 2;
+  p = tiff_entry(p, 256, 4, 1, sw->width);
+  p = tiff_entry(p, 257, 4, 1, sw->height);
+  p = tiff_entry(p, 258, 3, 3, bits_off);
+  p = tiff_entry(p, 259, 3, 1, 1);
+  p = tiff_entry(p, 262, 3, 1, 2);
+  p = tiff_entry(p, 273, 4, nstrip, (nstrip == 1) ? data_off : offs_off);
+  p = tiff_entry(p, 277, 3, 1, 3);
+  p = tiff_entry(p, 278, 4, 1, strip_height);
+  p = tiff_entry
+    (p, 279, 4, nstrip, (nstrip == 1) ? row_size * sw->height : counts_off);
+  p = tiff_entry(p, 282, 5, 1, res_off);
+  p = tiff_entry(p, 283, 5, 1, res_off + 8);
+  p = tiff_entry(p, 284, 3, 1, 1);
+  /* resolution in pixels per inch */
+  p = tiff_entry(p, 296, 3, 1, 2);
+  memcpy(p, &next_ifd, 4);
+  p += 4;
+
+  for (i = 0; i < 3; ++i, p += 2) memcpy(p, &bits, 2);
+
+  /* x then y resolution, as rationals */
+  for (i = 0; i < 2; ++i, p += 8) memcpy(p, res, 8);
+
+  /* strip offsets then byte counts, the last strip may be shorter */
+  for (i = 0, off = data_off; i < nstrip; ++i, p += 4)
+  {
+    memcpy(p, &off, 4);
+    off += row_size * strip_height;
+  }
+
+  for (i = 0; i < nstrip; ++i, p += 4)
+  {
+    uint32_t count = row_size * strip_height;
+    if ((i == (nstrip - 1)) && (sw->height % strip_height))
+      count = row_size * (sw->height % strip_height);
+    memcpy(p, &count, 4);
+  }
+
+  if (write(sw->fd, buf, data_off) == (ssize_t)data_off) err = 0;
+
+  free(buf);
+
+  return err;
+}
+
+static int strip_writer_open
+(
+ struct strip_writer* sw,
+ const char* filename,
+ unsigned int width,
+ unsigned int height,
+ unsigned int strip_height
+)
+{
+  /* the format is ppm if filename ends with .ppm, tiff with .tif */
+  /* or .tiff. other extensions are refused */
+
+  const char* ext = strrchr(filename, '.');
+  char line_buf[64];
+  int line_len;
+
+  sw->fd = -1;
+
+  if (ext == NULL) ext = "";
+  if (strcmp(ext, ".ppm") == 0) sw->type = STRIP_PPM;
+  else if (strcmp(ext, ".tif") == 0) sw->type = STRIP_TIFF;
+  else if (strcmp(ext, ".tiff") == 0) sw->type = STRIP_TIFF;
+  else
+  {
+    printf("unsupported format %s, use .ppm, .tif or .tiff\n", filename);
+    return -1;
+  }
+
+  sw->width = width;
+  sw->height = height;
+
+  sw->fd = open(filename, O_RDWR | O_TRUNC | O_CREAT | O_BINARY, 0644);
+  if (sw->fd == -1) return -1;
+
+  if (sw->type == STRIP_TIFF)
+  {
+    if (strip_writer_tiff_header(sw, strip_height)) goto on_error;
+  }
+  else
+  {
+    line_len = sprintf(line_buf, "P6\n%u %u\n255\n", width, height);
+    if (write(sw->fd, line_buf, line_len) != line_len) goto on_error;
+  }
+
+  return 0;
+
+ on_error:
+  close(sw->fd);
+  sw->fd = -1;
+  return -1;
+}
+
+static int strip_writer_add(struct strip_writer* sw, IplImage* im)
+{
+  /* append the rows of the bgr image im. im is converted in place */
+
+  const unsigned int row_size = sw->width * 3;
+  unsigned char* row;
+  unsigned int i;
+  int y;
+
+  if (sw->fd == -1) return -1;
+
+  for (y = 0; y < im->height; ++y)
+  {
+    row = (unsigned char*)(im->imageData + y * im->widthStep);
+
+    for (i = 0; i < row_size; i += 3)
+    {
+      const unsigned char b = row[i + 0];
+      row[i + 0] = row[i + 2];
+      row[i + 2] = b;
+    }
+
+    if (write(sw->fd, row, row_size) != (ssize_t)row_size)
+    {
+      close(sw->fd);
+      sw->fd = -1;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int strip_writer_close(struct strip_writer* sw)
+{
+  if (sw->fd == -1) return -1;
+  close(sw->fd);
+  return 0;
+}
+
+
+/* render */
+
+struct render_info
+{
+  struct index_info* ii;
+  struct mozaic_info* mi;
+
+  /* destination, its first row is the cell row y0 */
+  IplImage* im;
+  int y0;
+
+  /* cells to render, first to first + ncell - 1 if cells is NULL */
+  /* claimed nchunk at once */
+  unsigned int first;
+  const unsigned int* cells;
+  unsigned int ncell;
+  unsigned int nchunk;
+  unsigned int pos;
+};
+
+static void* render_main(void* param)
+{
+  /* worker, blit the tiles of the claimed cells. tiles missing */
+  /* from the cache are decoded here, concurrently with the other */
+  /* workers, and cells write disjoint regions of the image */
+
+  struct render_info* const ri = param;
+  struct mozaic_info* const mi = ri->mi;
+  struct resampler rs;
+  const unsigned char* pix;
+  int step;
+  unsigned int i;
+  unsigned int j;
+
+  if (mi->npix != CONFIG_NPIX)
+    resampler_init(&rs, CONFIG_NPIX, CONFIG_NPIX, mi->npix, mi->npix);
+
+  while ((i = __sync_fetch_and_add(&ri->pos, ri->nchunk)) < ri->ncell)
+  {
+    j = i + ri->nchunk;
+    if (j > ri->ncell) j = ri->ncell;
+
+    for (; i < j; ++i)
+    {
+      const unsigned int c = (ri->cells != NULL) ? ri->cells[i] : ri->first + i;
+      const unsigned int id = mi->tile_arr[c];
+      const int x = c % mi->w;
+      const int y = c / mi->w - ri->y0;
+
+      pix = index_get_tile(ri->ii, id, &step);
+      blit_tile(ri->im, x, y, mi->npix, pix, step, &rs);
+      index_put_tile(ri->ii, id);
+    }
+  }
+
+  if (mi->npix != CONFIG_NPIX) resampler_fini(&rs);
+
+  return NULL;
+}
+
+static void do_render
+(
+ struct index_info* ii,
+ struct mozaic_info* mi,
+ IplImage* im,
+ unsigned int first,
+ const unsigned int* cells,
+ unsigned int ncell,
+ unsigned int nchunk,
+ unsigned int nthread
+)
+{
+  struct render_info ri;
+  pthread_t* threads;
+  unsigned int i;
+
+  ri.ii = ii;
+  ri.mi = mi;
+  ri.im = im;
+  ri.y0 = first / mi->w;
+  ri.first = first;
+  ri.cells = cells;
+  ri.ncell = ncell;
+  ri.nchunk = nchunk;
+  ri.pos = 0;
+
+  nthread = get_nthread(nthread);
+  if (nthread > ((ncell + nchunk - 1) / nchunk))
+    nthread = (ncell + nchunk - 1) / nchunk;
+
+  threads = malloc(nthread * sizeof(pthread_t));
+  for (i = 0; i < nthread; ++i)
+    pthread_create(&threads[i], NULL, render_main, &ri);
+  for (i = 0; i < nthread; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+static void make_tile_im(struct mozaic_info* mi)
+{
+  CvSize tile_size;
+
+  if (mi->tile_im != NULL) return ;
+
+  tile_size.width = mi->w * mi->npix;
+  tile_size.height = mi->h * mi->npix;
+  mi->tile_im = cvCreateImage(tile_size, IPL_DEPTH_8U, 3);
+}
+
+static void do_make
+(struct index_info* ii, struct mozaic_info* mi, unsigned int nthread)
+{
+  /* render every cell, workers claim whole rows */
+
+  printf("[ do_make ] %d x %d cells\n", mi->w, mi->h);
+
+  make_tile_im(mi);
+  do_render(ii, mi, mi->tile_im, 0, NULL, mi->w * mi->h, mi->w, nthread);
+}
+
+static int do_make_strips
+(
+ struct index_info* ii,
+ struct mozaic_info* mi,
+ const char* filename,
+ unsigned int nthread
+)
+{
+  /* render without the whole image in memory. each row of cells */
+  /* is rendered in a strip image then appended to filename */
+
+  struct strip_writer sw;
+  IplImage* strip_im;
+  CvSize strip_size;
+  int err = -1;
+  int y;
+
+  printf("[ do_make_strips ] %d x %d cells\n", mi->w, mi->h);
+
+  if (strip_writer_open
+      (&sw, filename, mi->w * mi->npix, mi->h * mi->npix, mi->npix))
+  {
+    printf("cannot write %s\n", filename);
+    return -1;
+  }
+
+  strip_size.width = mi->w * mi->npix;
+  strip_size.height = mi->npix;
+  strip_im = cvCreateImage(strip_size, IPL_DEPTH_8U, 3);
+
+  for (y = 0; y < mi->h; ++y)
+  {
+    do_render(ii, mi, strip_im, y * mi->w, NULL, mi->w, 1, nthread);
+    if (strip_writer_add(&sw, strip_im)) goto on_error;
+  }
+
+  err = 0;
+
+ on_error:
+  if (strip_writer_close(&sw)) err = -1;
+  cvReleaseImage(&strip_im);
+  if (err) printf("cannot write %s\n", filename);
+  return err;
+}
+
+
+/* image editor */
+
+struct hist_node
+{
+  unsigned int id;
+  struct hist_node* next;
+  struct hist_node* prev;
+};
+
+/* nearest entries of a cell, by increasing distance. they are */
+/* found ED_NCAND first, then twice as many each time the list is */
+/* exhausted. pos is the next rank to propose */
+#define ED_NCAND 16
+
+struct ed_cand
+{
+  unsigned int* id;
+  unsigned int n;
+  unsigned int k;
+  unsigned int pos;
+  /* the tiled entry, and whether the list was built once the */
+  /* history held other entries, which may then have any rank. */
+  /* always the case for a quantized list that was extended */
+  unsigned int tiled_id;
+  unsigned int is_stale_hist;
+};
+
+/* editor cell flags */
+#define ED_SEL (1 << 0)
+/* the cell region of ed_im must be recomposed */
+#define ED_DIRTY_VIEW (1 << 1)
+/* the cell tile changed, and must be rendered in mi->tile_im first */
+#define ED_DIRTY_TILE (1 << 2)
+
+struct ed_info
+{
+  struct mozaic_info* mi;
+  struct index_info* ii;
+  /* arrays of mi->h x mi->w */
+  struct hist_node** hist_arr;
+  struct hist_node** hist_pos;
+  IplImage* ed_im;
+  int hs;
+  int ws;
+  /* mi->tile_im to ed_im */
+  struct resampler rs;
+
+  /* ED_xxx flags of each cell, and the dirty cells */
+  unsigned char* cell_flags;
+  unsigned int* dirty_cells;
+  unsigned int ndirty;
+
+  /* selected cells, as ED_SEL flags and a dense list. sel_pos is */
+  /* the list position of a selected cell. last_sel is the last */
+  /* selected cell still selected, or INDEX_NONE */
+  unsigned int* sel_cells;
+  unsigned int* sel_pos;
+  unsigned int nsel;
+  unsigned int last_sel;
+
+  /* ranked alternatives of each cell, built on first use */
+  struct ed_cand* cands;
+
+  unsigned int is_buttondown;
+  unsigned int is_lbutton;
+  int button_tile_x;
+  int button_tile_y;
+
+  char line_buf[128];
+  int line_pos;
+};
+
+static void mark_ed(struct ed_info* ei, int x, int y, unsigned char flags)
+{
+  /* add flags to the cell x, y, and to the dirty list if needed */
+
+  const unsigned int i = y * ei->mi->w + x;
+
+  if ((ei->cell_flags[i] & (ED_DIRTY_VIEW | ED_DIRTY_TILE)) == 0)
+    ei->dirty_cells[ei->ndirty++] = i;
+
+  ei->cell_flags[i] |= flags | ED_DIRTY_VIEW;
+}
+
+static void set_ed_tile(struct ed_info* ei, unsigned int i, unsigned int id)
+{
+  struct mozaic_info* const mi = ei->mi;
+  const int x = i % mi->w;
+  const int y = i / mi->w;
+
+  if (mi->tile_arr[i] == id) return ;
+
+  mi->tile_arr[i] = id;
+  mark_ed(ei, x, y, ED_DIRTY_TILE);
+
+  /* ed_im pixels across cell borders depend on the neighbor tiles */
+  if ((mi->npix % ei->ws) || (mi->npix % ei->hs))
+  {
+    int nx;
+    int ny;
+
+    for (ny = y - 1; ny <= (y + 1); ++ny)
+    {
+      if ((ny < 0) || (ny >= mi->h)) continue ;
+      for (nx = x - 1; nx <= (x + 1); ++nx)
+      {
+	if ((nx < 0) || (nx >= mi->w)) continue ;
+	mark_ed(ei, nx, ny, 0);
+      }
+    }
+  }
+}
+
+static void select_ed(struct ed_info* ei, int x, int y, unsigned int is_sel)
+{
+  /* add or remove the cell x, y from the selection */
+
+  const unsigned int i = y * ei->mi->w + x;
+
+  if (((ei->cell_flags[i] & ED_SEL) != 0) == (is_sel != 0)) return ;
+
+  if (is_sel)
+  {
+    ei->sel_pos[i] = ei->nsel;
+    ei->sel_cells[ei->nsel++] = i;
+    ei->cell_flags[i] |= ED_SEL;
+    ei->last_sel = i;
+  }
+  else
+  {
+    /* the last one takes its place */
+    const unsigned int j = ei->sel_cells[--ei->nsel];
+    ei->sel_cells[ei->sel_pos[i]] = j;
+    ei->sel_pos[j] = ei->sel_pos[i];
+    ei->cell_flags[i] &= ~ED_SEL;
+
+    if (ei->last_sel == i)
+      ei->last_sel = ei->nsel ? ei->sel_cells[ei->nsel - 1] : INDEX_NONE;
+  }
+
+  mark_ed(ei, x, y, 0);
+}
+
+static void select_ed_rect
+(struct ed_info* ei, int x0, int y0, int x1, int y1, unsigned int is_sel)
+{
+  /* add or remove the cells x0, y0 to x1, y1 included */
+
+  int x;
+  int y;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 >= ei->mi->w) x1 = ei->mi->w - 1;
+  if (y1 >= ei->mi->h) y1 = ei->mi->h - 1;
+
+  for (y = y0; y <= y1; ++y)
+    for (x = x0; x <= x1; ++x)
+      select_ed(ei, x, y, is_sel);
+}
+
+static void draw_sel(IplImage* im, int x0, int y0, int x1, int y1)
+{
+  /* purple frame inside x0, y0 to x1 - 1, y1 - 1 */
+
+  static const unsigned char purple[3] = { 0xff, 0, 0xff };
+  const int t = 2;
+  int x;
+  int y;
+
+  for (y = y0; y < y1; ++y)
+  {
+    unsigned char* const row = (unsigned char*)
+      (im->imageData + y * im->widthStep);
+    const unsigned int is_edge = ((y - y0) < t) || ((y1 - y) <= t);
+
+    for (x = x0; x < x1; ++x)
+    {
+      if (is_edge || ((x - x0) < t) || ((x1 - x) <= t))
+	memcpy(row + x * 3, purple, 3);
+    }
+  }
+}
+
+static void compose_ed(struct ed_info* ei)
+{
+  /* recompose the dirty cells of ei->ed_im. changed tiles are */
+  /* rendered, then the cell regions are scaled down from */
+  /* mi->tile_im and the selection drawn over. regions partition */
+  /* ed_im, so the cost only depends on the dirty cells */
+
+  struct mozaic_info* const mi = ei->mi;
+  uint64_t t;
+  unsigned int* tiles;
+  unsigned int ntile;
+  unsigned int i;
+
+  if (ei->ndirty == 0) return ;
+
+  t = stats_start();
+
+  tiles = malloc(ei->ndirty * sizeof(unsigned int));
+  ntile = 0;
+  for (i = 0; i < ei->ndirty; ++i)
+  {
+    const unsigned int c = ei->dirty_cells[i];
+    if (ei->cell_flags[c] & ED_DIRTY_TILE) tiles[ntile++] = c;
+  }
+
+  if (ntile) do_render(ei->ii, mi, mi->tile_im, 0, tiles, ntile, 1, 0);
+  free(tiles);
+
+  for (i = 0; i < ei->ndirty; ++i)
+  {
+    const unsigned int c = ei->dirty_cells[i];
+    const int x = c % mi->w;
+    const int y = c / mi->w;
+    const int x0 = (x * mi->npix) / ei->ws;
+    const int y0 = (y * mi->npix) / ei->hs;
+    int x1 = ((x + 1) * mi->npix) / ei->ws;
+    int y1 = ((y + 1) * mi->npix) / ei->hs;
+
+    if (x1 > ei->ed_im->width) x1 = ei->ed_im->width;
+    if (y1 > ei->ed_im->height) y1 = ei->ed_im->height;
+
+    resampler_run(&ei->rs, mi->tile_im, ei->ed_im, x0, y0, x1, y1);
+    if (ei->cell_flags[c] & ED_SEL) draw_sel(ei->ed_im, x0, y0, x1, y1);
+
+    ei->cell_flags[c] &= ED_SEL;
+  }
+
+  ei->ndirty = 0;
+
+  stats_stop(&stats.redraw, t);
+}
+
+static void redraw_ed(struct ed_info* ei)
+{
+  if (ei->ndirty == 0) return ;
+  compose_ed(ei);
+  cvShowImage("ed", ei->ed_im);
+}
+
+static void on_mouse(int event, int x, int y, int flags, void* param)
+{
+  struct ed_info* const ei = param;
+
+  switch (event)
+  {
+  case CV_EVENT_RBUTTONDOWN:
+  case CV_EVENT_LBUTTONDOWN:
+    {
+      if (ei->is_buttondown) break ;
+
+      ei->is_buttondown = 1;
+
+      if (event == CV_EVENT_LBUTTONDOWN) ei->is_lbutton = 1;
+      else ei->is_lbutton = 0;
+
+      ei->button_tile_x = (x * ei->ws) / ei->mi->npix;
+      ei->button_tile_y = (y * ei->hs) / ei->mi->npix;
+
+      goto cv_event_mousemove_case;
+
+      break ;
+    }
+
+  case CV_EVENT_RBUTTONUP:
+  case CV_EVENT_LBUTTONUP:
+    {
+      ei->is_buttondown = 0;
+      break ;
+    }
+
+  case CV_EVENT_MOUSEMOVE:
+  cv_event_mousemove_case:
+    {
+      int tile_x;
+      int tile_y;
+      int min_tile_x;
+      int max_tile_x;
+      int min_tile_y;
+      int max_tile_y;
+
+      if (ei->is_buttondown == 0) break ;
+
+      tile_x = (x * ei->ws) / ei->mi->npix;
+      tile_y = (y * ei->hs) / ei->mi->npix;
+
+      min_tile_x = tile_x < ei->button_tile_x ? tile_x : ei->button_tile_x;
+      max_tile_x = tile_x > ei->button_tile_x ? tile_x : ei->button_tile_x;
+      min_tile_y = tile_y < ei->button_tile_y ? tile_y : ei->button_tile_y;
+      max_tile_y = tile_y > ei->button_tile_y ? tile_y : ei->button_tile_y;
+
+      /* select with the left button, unselect with the right one */
+      select_ed_rect
+	(ei, min_tile_x, min_tile_y, max_tile_x, max_tile_y, ei->is_lbutton);
+
+      redraw_ed(ei);
+
+      break ;
+    }
+
+  default: break ;
+  }
+}
+
+static unsigned int is_in_hist(const struct hist_node* hn, unsigned int id)
+{
+  for (; hn; hn = hn->next)
+    if (hn->id == id) return 1;
+  return 0;
+}
+
+static unsigned int next_ed_cand(struct ed_info* ei, unsigned int i)
+{
+  /* the best entry of the cell i not yet in its history, or */
+  /* INDEX_NONE. the history holds the tiled entry, at its tail, */
+  /* and the entries proposed before, in rank order, so that only */
+  /* the tiled entry has to be skipped, unless the list was rebuilt */
+
+  struct ed_cand* const ec = &ei->cands[i];
+  const struct index_info* const ii = ei->ii;
+  unsigned int id;
+
+  while (1)
+  {
+    if (ec->pos == ec->n)
+    {
+      struct knn_info ki;
+
+      /* exhausted, find more */
+      if (ec->n == ii->n) return INDEX_NONE;
+
+      ec->k = ec->k ? ec->k * 2 : ED_NCAND;
+      if (ec->k > ii->n) ec->k = ii->n;
+      if (ec->id == NULL)
+      {
+	struct hist_node* tail = ei->hist_arr[i];
+	ec->is_stale_hist = (tail->next != NULL);
+	while (tail->next) tail = tail->next;
+	ec->tiled_id = tail->id;
+      }
+      else if (ii->pq != NULL)
+      {
+	/* the rerank set grows with k, so the longer list may order */
+	/* its first entries differently. walk it again from the */
+	/* start, skipping what the history already holds */
+	ec->is_stale_hist = 1;
+	ec->pos = 0;
+      }
+
+      ec->id = realloc(ec->id, ec->k * sizeof(unsigned int));
+      ki.k = ec->k;
+      ki.id = ec->id;
+      ki.dist = malloc(ec->k * sizeof(unsigned int));
+      index_find_knn(ii, ei->mi->desc + i * DESC_STRIDE, &ki);
+      stats_add(&stats.nquery, 1);
+      stats_add(&stats.nscan, ki.nscan);
+      free(ki.dist);
+      ec->n = ki.n;
+
+      if (ec->pos >= ec->n) return INDEX_NONE;
+    }
+
+    id = ec->id[ec->pos++];
+
+    if (id == ec->tiled_id) continue ;
+    if (ec->is_stale_hist && is_in_hist(ei->hist_arr[i], id)) continue ;
+
+    return id;
+  }
+}
+
+static void reset_ed_cands(struct ed_info* ei)
+{
+  /* the ranking changed, lists are rebuilt on next use */
+
+  const unsigned int n = ei->mi->w * ei->mi->h;
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+  {
+    free(ei->cands[i].id);
+    ei->cands[i].id = NULL;
+    ei->cands[i].n = 0;
+    ei->cands[i].k = 0;
+    ei->cands[i].pos = 0;
+  }
+}
+
+/* mosaic sessions. a binary file of the grid, the entry ids, the */
+/* cell descriptors and the editor history, enough to render or */
+/* edit again without matching. ids are only valid with the index */
+/* they were chosen from, whose stamp is kept */
+
+#define SESSION_MAGIC "TLMZ"
+#define SESSION_VERSION 1
+
+struct session_header
+{
+  char magic[4];
+  uint32_t version;
+  /* cells, and pixels per tile */
+  uint32_t w;
+  uint32_t h;
+  uint32_t npix;
+  /* CONFIG_NGRID of the cell descriptors */
+  uint32_t ngrid;
+  /* the index of the ids */
+  uint32_t stamp;
+  uint32_t count;
+  /* history ids, sum of the per cell lengths */
+  uint32_t nhist;
+  uint32_t pad;
+};
+
+/* followed by, for the w x h cells: the ids, the DESC_DIM bytes */
+/* descriptors padded to 4 bytes, the history lengths, the history */
+/* positions, then the history ids of each cell from head to tail. */
+/* a cell without history has a length of 0 */
+
+#define SESSION_DESC_SIZE(__ncell) ((((__ncell) * DESC_DIM) + 3) & ~3)
+
+struct session_hist
+{
+  /* per cell length, position and offset in ids */
+  unsigned int* n;
+  unsigned int* pos;
+  unsigned int* off;
+  unsigned int* ids;
+};
+
+static int session_save
+(
+ const struct index_info* ii,
+ const struct mozaic_info* mi,
+ const struct ed_info* ei,
+ const char* filename
+)
+{
+  /* ei is the editor of mi, or NULL for no history. built in */
+  /* memory, written at once aside then renamed */
+
+  const unsigned int ncell = mi->w * mi->h;
+  struct session_header* h;
+  char tmp_filename[512];
+  unsigned char* buf;
+  unsigned char* p;
+  uint32_t* n;
+  uint32_t* pos;
+  uint32_t* ids;
+  size_t size;
+  uint32_t nhist = 0;
+  unsigned int i;
+  int err = -1;
+  int len;
+  int fd;
+
+  if (ei != NULL)
+  {
+    for (i = 0; i < ncell; ++i)
+    {
+      const struct hist_node* hn;
+      for (hn = ei->hist_arr[i]; hn; hn = hn->next) ++nhist;
+    }
+  }
+
+  size = sizeof(struct session_header) + ncell * sizeof(uint32_t) +
+    SESSION_DESC_SIZE(ncell) + 2 * ncell * sizeof(uint32_t) +
+    nhist * sizeof(uint32_t);
+  buf = calloc(1, size);
+
+  h = (struct session_header*)buf;
+  memcpy(h->magic, SESSION_MAGIC, 4);
+  h->version = SESSION_VERSION;
+  h->w = mi->w;
+  h->h = mi->h;
+  h->npix = mi->npix;
+  h->ngrid = CONFIG_NGRID;
+  h->stamp = ii->map.h->stamp;
+  h->count = ii->n;
+  h->nhist = nhist;
+
+  p = buf + sizeof(struct session_header);
+  memcpy(p, mi->tile_arr, ncell * sizeof(uint32_t));
+  p += ncell * sizeof(uint32_t);
+
+  for (i = 0; i < ncell; ++i)
+    memcpy(p + i * DESC_DIM, mi->desc + i * DESC_STRIDE, DESC_DIM);
+  p += SESSION_DESC_SIZE(ncell);
+
+  n = (uint32_t*)p;
+  pos = n + ncell;
+  ids = pos + ncell;
+
+  for (i = 0; (ei != NULL) && (i < ncell); ++i)
+  {
+    const struct hist_node* hn;
+
+    for (hn = ei->hist_arr[i]; hn; hn = hn->next)
+    {
+      if (hn == ei->hist_pos[i]) pos[i] = n[i];
+      *(ids++) = hn->id;
+      ++n[i];
+    }
+  }
+
+  len = snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+  if ((len < 0) || ((size_t)len >= sizeof(tmp_filename))) goto on_error;
+
+  fd = open(tmp_filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (fd == -1) goto on_error;
+  if (write(fd, buf, size) != (ssize_t)size) goto on_error_close;
+  close(fd);
+  fd = -1;
+
+  if (rename(tmp_filename, filename)) goto on_error;
+
+  err = 0;
+
+ on_error_close:
+  if (fd != -1) close(fd);
+ on_error:
+  if (err) printf("cannot write %s\n", filename);
+  free(buf);
+  return err;
+}
+
+static void session_hist_free(struct session_hist* sh)
+{
+  free(sh->n);
+  free(sh->pos);
+  free(sh->off);
+  free(sh->ids);
+}
+
+static int session_load
+(
+ const struct index_info* ii,
+ struct mozaic_info* mi,
+ struct session_hist* sh,
+ const char* filename
+)
+{
+  /* fill mi, and sh if not NULL, from a session of ii */
+
+  const struct session_header* h;
+  const unsigned char* p;
+  const uint32_t* ids;
+  const uint32_t* n;
+  const uint32_t* pos;
+  const uint32_t* hist_ids;
+  unsigned char* addr;
+  uint64_t ncell;
+  uint64_t nhist;
+  size_t size;
+  unsigned int i;
+
+  addr = map_file(filename, &size);
+  if (addr == NULL) goto on_error;
+
+  h = (const struct session_header*)addr;
+  if (size < sizeof(struct session_header)) goto on_error_unmap;
+  if (memcmp(h->magic, SESSION_MAGIC, 4)) goto on_error_unmap;
+  if (h->version != SESSION_VERSION) goto on_error_unmap;
+  if (h->ngrid != CONFIG_NGRID) goto on_error_unmap;
+  if ((h->w == 0) || (h->h == 0) || (h->npix == 0)) goto on_error_unmap;
+
+  if ((h->stamp != ii->map.h->stamp) || (h->count != ii->n))
+  {
+    printf("%s was made with another index\n", filename);
+    unmap_file(addr, size);
+    return -1;
+  }
+
+  ncell = (uint64_t)h->w * h->h;
+  if (size != (sizeof(struct session_header) + ncell * 4 +
+	       SESSION_DESC_SIZE(ncell) + ncell * 8 + (uint64_t)h->nhist * 4))
+    goto on_error_unmap;
+
+  p = addr + sizeof(struct session_header);
+  ids = (const uint32_t*)p;
+  p += ncell * sizeof(uint32_t);
+  n = (const uint32_t*)(p + SESSION_DESC_SIZE(ncell));
+  pos = n + ncell;
+  hist_ids = pos + ncell;
+
+  nhist = 0;
+  for (i = 0; i < ncell; ++i)
+  {
+    if (ids[i] >= ii->n) goto on_error_unmap;
+    if (n[i] && (pos[i] >= n[i])) goto on_error_unmap;
+    nhist += n[i];
+  }
+  if (nhist != h->nhist) goto on_error_unmap;
+  for (i = 0; i < nhist; ++i)
+    if (hist_ids[i] >= ii->n) goto on_error_unmap;
+
+  mi->w = h->w;
+  mi->h = h->h;
+  mi->npix = h->npix;
+  mi->tile_im = NULL;
+  mi->tile_arr = malloc(ncell * sizeof(unsigned int));
+  memcpy(mi->tile_arr, ids, ncell * sizeof(unsigned int));
+  mi->desc = calloc(ncell, DESC_STRIDE);
+  for (i = 0; i < ncell; ++i)
+    memcpy(mi->desc + i * DESC_STRIDE, p + i * DESC_DIM, DESC_DIM);
+
+  if (sh != NULL)
+  {
+    sh->n = malloc(ncell * sizeof(unsigned int));
+    sh->pos = malloc(ncell * sizeof(unsigned int));
+    sh->off = malloc(ncell * sizeof(unsigned int));
+    sh->ids = malloc((nhist ? nhist : 1) * sizeof(unsigned int));
+    memcpy(sh->n, n, ncell * sizeof(unsigned int));
+    memcpy(sh->pos, pos, ncell * sizeof(unsigned int));
+    memcpy(sh->ids, hist_ids, nhist * sizeof(unsigned int));
+    for (nhist = 0, i = 0; i < ncell; nhist += n[i], ++i)
+      sh->off[i] = (unsigned int)nhist;
+  }
+
+  unmap_file(addr, size);
+
+  return 0;
+
+ on_error_unmap:
+  unmap_file(addr, size);
+ on_error:
+  printf("invalid session %s\n", filename);
+  return -1;
+}
+
+static void ed_init
+(
+ struct ed_info* ei,
+ struct index_info* ii,
+ struct mozaic_info* mi,
+ const struct session_hist* sh
+)
+{
+  /* render the mosaic and its scaled down view, no window. the */
+  /* history of the cells is restored from sh if not NULL */
+
+  CvSize ed_size;
+  int i;
+
+  ei->ii = ii;
+  ei->mi = mi;
+
+  ei->line_pos = 0;
+  ei->is_buttondown = 0;
+
+  ei->sel_cells = malloc(mi->w * mi->h * sizeof(unsigned int));
+  ei->sel_pos = malloc(mi->w * mi->h * sizeof(unsigned int));
+  ei->nsel = 0;
+  ei->last_sel = INDEX_NONE;
+
+  ei->cands = calloc(mi->w * mi->h, sizeof(struct ed_cand));
+
+  ei->hs = mi->h * mi->npix / 700;
+  if (ei->hs == 0) ei->hs = 1;
+  ei->ws = ei->hs;
+
+  ed_size.height = (mi->h * mi->npix) / ei->hs;
+  ed_size.width = (mi->w * mi->npix) / ei->ws;
+  ei->ed_im = cvCreateImage(ed_size, IPL_DEPTH_8U, 3);
+  resampler_init
+    (&ei->rs, ed_size.width * ei->ws, ed_size.height * ei->hs,
+     ed_size.width, ed_size.height);
+
+  ei->cell_flags = calloc(mi->w * mi->h, sizeof(unsigned char));
+  ei->dirty_cells = malloc(mi->w * mi->h * sizeof(unsigned int));
+  ei->ndirty = 0;
+
+  do_make(ii, mi, 0);
+  resampler_run
+    (&ei->rs, mi->tile_im, ei->ed_im, 0, 0, ed_size.width, ed_size.height);
+
+  /* initialize hist related arrays */
+  ei->hist_pos = malloc(mi->w * mi->h * sizeof(struct hist_node*));
+  ei->hist_arr = malloc(mi->w * mi->h * sizeof(struct hist_node*));
+  for (i = 0; i < (mi->w * mi->h); ++i)
+  {
+    struct hist_node* hn;
+    struct hist_node* prev = NULL;
+    unsigned int j;
+
+    if ((sh == NULL) || (sh->n[i] == 0))
+    {
+      hn = malloc(sizeof(struct hist_node));
+      hn->id = mi->tile_arr[i];
+      hn->next = NULL;
+      hn->prev = NULL;
+
+      ei->hist_arr[i] = hn;
+      ei->hist_pos[i] = hn;
+      continue ;
+    }
+
+    /* from head to tail */
+    for (j = 0; j < sh->n[i]; ++j)
+    {
+      hn = malloc(sizeof(struct hist_node));
+      hn->id = sh->ids[sh->off[i] + j];
+      hn->next = NULL;
+      hn->prev = prev;
+
+      if (prev != NULL) prev->next = hn;
+      else ei->hist_arr[i] = hn;
+      if (j == sh->pos[i]) ei->hist_pos[i] = hn;
+
+      prev = hn;
+    }
+  }
+}
+
+static void ed_fini(struct ed_info* ei)
+{
+  const int n = ei->mi->w * ei->mi->h;
+  int i;
+
+  /* release hist related arrays */
+  for (i = 0; i < n; ++i)
+  {
+    struct hist_node* hn = ei->hist_arr[i];
+    while (hn)
+    {
+      struct hist_node* const tmp = hn;
+      hn = hn->next;
+      free(tmp);
+    }
+  }
+  free(ei->hist_arr);
+  free(ei->hist_pos);
+
+  free(ei->cell_flags);
+  free(ei->dirty_cells);
+  free(ei->sel_cells);
+  free(ei->sel_pos);
+  reset_ed_cands(ei);
+  free(ei->cands);
+  resampler_fini(&ei->rs);
+  cvReleaseImage(&ei->ed_im);
+}
+
+static void ed_prev(struct ed_info* ei)
+{
+  /* select the next less matching tile of the selected cells */
+
+  unsigned int i;
+  unsigned int j;
+
+  for (j = 0; j < ei->nsel; ++j)
+  {
+    i = ei->sel_cells[j];
+
+    if (ei->hist_pos[i]->prev)
+    {
+      /* already one previous tile */
+      ei->hist_pos[i] = ei->hist_pos[i]->prev;
+    }
+    else
+    {
+      /* select the next non used tile */
+
+      unsigned int id;
+      struct hist_node* hn;
+
+      id = next_ed_cand(ei, i);
+      if (id != INDEX_NONE)
+      {
+	hn = malloc(sizeof(struct hist_node));
+	hn->id = id;
+	hn->prev = NULL;
+	hn->next = ei->hist_pos[i];
+	ei->hist_pos[i]->prev = hn;
+	ei->hist_pos[i] = hn;
+	ei->hist_arr[i] = hn;
+      }
+    }
+
+    set_ed_tile(ei, i, ei->hist_pos[i]->id);
+  }
+}
+
+static void ed_next(struct ed_info* ei)
+{
+  /* select next tile in history */
+
+  unsigned int i;
+  unsigned int j;
+
+  for (j = 0; j < ei->nsel; ++j)
+  {
+    i = ei->sel_cells[j];
+    if (ei->hist_pos[i]->next) ei->hist_pos[i] = ei->hist_pos[i]->next;
+    set_ed_tile(ei, i, ei->hist_pos[i]->id);
+  }
+}
+
+static void ed_replace(struct ed_info* ei)
+{
+  /* replace select tiles by last selected one */
+
+  unsigned int id;
+  unsigned int j;
+
+  if (ei->last_sel == INDEX_NONE) return ;
+
+  id = ei->mi->tile_arr[ei->last_sel];
+
+  for (j = 0; j < ei->nsel; ++j)
+    set_ed_tile(ei, ei->sel_cells[j], id);
+}
+
+static void do_edit
+(
+ struct index_info* ii,
+ struct mozaic_info* mi,
+ const struct session_hist* sh,
+ const char* filename
+)
+{
+  /* the session is saved to filename on exit, if not NULL */
+
+  struct ed_info ei;
+  int is_done = 0;
+  int is_update;
+
+  ed_init(&ei, ii, mi, sh);
+
+  /* setup ui */
+  cvNamedWindow("ed", CV_WINDOW_AUTOSIZE);
+  cvShowImage("ed", ei.ed_im);
+  cvSetMouseCallback("ed", on_mouse, (void*)&ei);
+
+  while (is_done == 0)
+  {
+    const int k = cvWaitKey(0);
+
+    is_update = 0;
+    switch (k & 0xff)
+    {
+      /* left arrow, select the next less matching tile */
+    case 0x51:
+      {
+	ed_prev(&ei);
+	is_update = 1;
+	break ;
+      }
+
+      /* right arrow */
+    case 0x53:
+      {
+	ed_next(&ei);
+	is_update = 1;
+	break ;
+      }
+
+      /* replace select tiles by last selected one */
+    case 'r':
+      {
+	ed_replace(&ei);
+	is_update = 1;
+	break ;
+      }
+
+    case 'w':
+      {
+	ei.line_buf[ei.line_pos] = 0;
+	ei.line_pos = 0;
+	sscanf(ei.line_buf, "%u %u %u", &dist_w[0], &dist_w[1], &dist_w[2]);
+	printf("dist_w: %u %u %u\n", dist_w[0], dist_w[1], dist_w[2]);
+	reset_ed_cands(&ei);
+	break ;
+      }
+
+      /* escape, done with edition */
+    case 27:
+      {
+	is_done = 1;
+	break ;
+      }
+
+    default:
+      {
+	const char c = k & 0xff;
+	if ((c == ' ') || ((c >= '0') && (c <= '9')))
+	  ei.line_buf[ei.line_pos++ % (sizeof(ei.line_buf) - 1)] = c;
+	else
+	  printf("unknown keycode: %x\n", k);
+	break ;
+      }
+    }
+
+    if (is_update) redraw_ed(&ei);
+  }
+
+  if (filename != NULL) session_save(ii, mi, &ei, filename);
+
+  ed_fini(&ei);
+}
+
+
+/* jobs. a job is a text line target ntil npix output, ntil and */
+/* npix 0 for the default. used by the batch and serve commands */
+
+struct job_info
+{
+  char target[256];
+  int ntil;
+  int npix;
+  char output[256];
+};
+
+static int parse_job(struct job_info* job, const char* line)
+{
+  if (sscanf(line, "%255s %d %d %255s",
+	     job->target, &job->ntil, &job->npix, job->output) != 4)
+    return -1;
+
+  if (job->ntil <= 0) job->ntil = CONFIG_NTIL;
+  if (job->npix <= 0) job->npix = CONFIG_NPIX;
+
+  return 0;
+}
+
+static int do_job
+(
+ struct index_info* ii,
+ const struct job_info* job,
+ unsigned int nthread,
+ struct mozaic_info* mi
+)
+{
+  /* tile then render job. jobs can run concurrently on the same */
+  /* ii, the tiling only reads it and the tile cache is locked */
+
+  int err;
+
+  mi->tile_im = NULL;
+  mi->npix = job->npix;
+
+  if (do_tile(job->target, ii, mi, job->ntil, nthread)) return -1;
+
+  err = do_make_strips(ii, mi, job->output, nthread);
+
+  free(mi->desc);
+  free(mi->tile_arr);
+
+  return err;
+}
+
+static int do_batch
+(struct index_info* ii, const char* filename, unsigned int nthread)
+{
+  /* run the jobs listed in filename, one per line. empty lines */
+  /* and lines starting with # are skipped. the index and the tile */
+  /* cache are shared by the jobs, that run one after the other */
+
+  struct job_info job;
+  struct mozaic_info mi;
+  const char* line;
+  unsigned int njob = 0;
+  unsigned int nerr = 0;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+  {
+    printf("cannot open %s\n", filename);
+    return -1;
+  }
+
+  while ((line = read_line(fd)) != NULL)
+  {
+    if ((line[0] == 0) || (line[0] == '#')) continue ;
+
+    if (parse_job(&job, line))
+    {
+      printf("invalid job: %s\n", line);
+      ++nerr;
+      continue ;
+    }
+
+    printf("[ do_batch ] %s %d %d %s\n",
+	   job.target, job.ntil, job.npix, job.output);
+    ++njob;
+
+    if (do_job(ii, &job, nthread, &mi)) ++nerr;
+  }
+
+  close(fd);
+
+  printf("[ do_batch ] %u jobs, %u errors\n", njob, nerr);
+
+  return nerr ? -1 : 0;
+}
+
+
+/* server. jobs are received over a unix socket, one line per job, */
+/* answered by ok w h or error. each connection has its thread, a */
+/* quit line stops the server once the connections are closed */
+
+#ifndef _WIN32
+
+struct server_info
+{
+  struct index_info* ii;
+  unsigned int nthread;
+  int fd;
+
+  /* written by quit to wake up the accept loop */
+  int wake_fd[2];
+
+  /* open connections */
+  unsigned int nconn;
+  unsigned int is_done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct conn_info
+{
+  struct server_info* si;
+  int fd;
+};
+
+static void* conn_main(void* param)
+{
+  struct conn_info* const ci = param;
+  struct server_info* const si = ci->si;
+  struct job_info job;
+  struct mozaic_info mi;
+  char line_buf[1024];
+  char reply[64];
+  const char* line;
+  int len;
+
+  while ((line = read_line_buf(ci->fd, line_buf, sizeof(line_buf))) != NULL)
+  {
+    if (strcmp(line, "stats") == 0)
+    {
+      /* counters so far, as a json line */
+      FILE* const file = fdopen(dup(ci->fd), "w");
+      if (file == NULL) break ;
+      stats_print(file, 1);
+      fclose(file);
+      continue ;
+    }
+
+    if (strcmp(line, "quit") == 0)
+    {
+      /* wake up the accept loop */
+      const char c = 0;
+      pthread_mutex_lock(&si->lock);
+      si->is_done = 1;
+      pthread_mutex_unlock(&si->lock);
+      if (write(si->wake_fd[1], &c, 1) != 1)
+	printf("cannot wake up the server\n");
+      break ;
+    }
+
+    if (parse_job(&job, line) || do_job(si->ii, &job, si->nthread, &mi))
+      len = sprintf(reply, "error\n");
+    else
+      len = sprintf(reply, "ok %d %d\n", mi.w, mi.h);
+
+    if (write(ci->fd, reply, len) != len) break ;
+  }
+
+  close(ci->fd);
+  free(ci);
+
+  pthread_mutex_lock(&si->lock);
+  --si->nconn;
+  pthread_cond_broadcast(&si->cond);
+  pthread_mutex_unlock(&si->lock);
+
+  return NULL;
+}
+
+static int do_serve
+(struct index_info* ii, const char* path, unsigned int nthread)
+{
+  /* the listening socket is polled along with the wake pipe, and */
+  /* non blocking so that a connection gone before accept does not */
+  /* block. running out of descriptors is retried after a pause */
+
+  struct server_info si;
+  struct sockaddr_un addr;
+  pthread_attr_t attr;
+  struct stat st;
+  int err = 0;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    printf("socket path too long\n");
+    return -1;
+  }
+
+  /* only a stale socket is replaced */
+  if (lstat(path, &st) == 0)
+  {
+    if (S_ISSOCK(st.st_mode) == 0)
+    {
+      printf("%s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16))
+  {
+    printf("cannot listen on %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  if (pipe(si.wake_fd))
+  {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  /* a client may leave before its reply */
+  signal(SIGPIPE, SIG_IGN);
+
+  si.ii = ii;
+  si.nthread = nthread;
+  si.fd = fd;
+  si.nconn = 0;
+  si.is_done = 0;
+  pthread_mutex_init(&si.lock, NULL);
+  pthread_cond_init(&si.cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  printf("[ do_serve ] %s\n", path);
+  fflush(stdout);
+
+  while (1)
+  {
+    struct conn_info* ci;
+    struct pollfd pfd[2];
+    pthread_t thread;
+    int conn_fd;
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = si.wake_fd[0];
+    pfd[1].events = POLLIN;
+
+    if (poll(pfd, 2, -1) == -1)
+    {
+      if (errno == EINTR) continue ;
+      err = -1;
+      break ;
+    }
+
+    pthread_mutex_lock(&si.lock);
+    if (si.is_done)
+    {
+      pthread_mutex_unlock(&si.lock);
+      break ;
+    }
+    pthread_mutex_unlock(&si.lock);
+
+    if ((pfd[0].revents & POLLIN) == 0) continue ;
+
+    conn_fd = accept(fd, NULL, NULL);
+    if (conn_fd == -1)
+    {
+      switch (errno)
+      {
+      case EINTR: case EAGAIN: case ECONNABORTED: continue ;
+#if (EWOULDBLOCK != EAGAIN)
+      case EWOULDBLOCK: continue ;
+#endif
+      case EMFILE: case ENFILE: case ENOBUFS: case ENOMEM:
+	/* until connections close, or quit */
+	poll(pfd + 1, 1, 100);
+	continue ;
+      default:
+	err = -1;
+	break ;
+      }
+      break ;
+    }
+
+    /* accepted sockets may inherit the non blocking flag */
+    fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) & ~O_NONBLOCK);
+
+    ci = malloc(sizeof(struct conn_info));
+    ci->si = &si;
+    ci->fd = conn_fd;
+
+    pthread_mutex_lock(&si.lock);
+    ++si.nconn;
+    pthread_mutex_unlock(&si.lock);
+
+    if (pthread_create(&thread, &attr, conn_main, ci))
+    {
+      close(conn_fd);
+      free(ci);
+      pthread_mutex_lock(&si.lock);
+      --si.nconn;
+      pthread_mutex_unlock(&si.lock);
+    }
+  }
+
+  /* wait for the connections using the index */
+  pthread_mutex_lock(&si.lock);
+  while (si.nconn) pthread_cond_wait(&si.cond, &si.lock);
+  pthread_mutex_unlock(&si.lock);
+
+  pthread_attr_destroy(&attr);
+  pthread_cond_destroy(&si.cond);
+  pthread_mutex_destroy(&si.lock);
+
+  close(si.wake_fd[0]);
+  close(si.wake_fd[1]);
+  close(fd);
+  unlink(path);
+
+  if (err) printf("cannot accept on %s\n", path);
+
+  return err;
+}
+
+#endif /* _WIN32 */
+
+
+/* benchmarks. a synthetic library and target are generated in a */
+/* directory, then the stages are timed one by one. results are */
+/* written as json, with latency percentiles of repeated stages */
+
+#define BENCH_NQUERY 2000
+#define BENCH_NRUN 5
+#define BENCH_NEDIT 200
+
+static inline uint32_t bench_rand(uint32_t* x)
+{
+  /* xorshift, the same sequence on every platform */
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+static void bench_fill(IplImage* im, uint32_t* seed)
+{
+  /* solid, gradient, checker or noisy image of random colors */
+
+  const unsigned int kind = bench_rand(seed) % 4;
+  const unsigned int period = 2 + bench_rand(seed) % 16;
+  unsigned char a[3];
+  unsigned char b[3];
+  unsigned char rgb[3];
+  int x;
+  int y;
+  int k;
+
+  for (k = 0; k < 3; ++k)
+  {
+    a[k] = bench_rand(seed);
+    b[k] = bench_rand(seed);
+  }
+
+  for (y = 0; y < im->height; ++y)
+    for (x = 0; x < im->width; ++x)
+    {
+      for (k = 0; k < 3; ++k)
+      {
+	switch (kind)
+	{
+	case 0: rgb[k] = a[k]; break ;
+	case 1: rgb[k] = a[k] + ((int)b[k] - a[k]) * x / im->width; break ;
+	case 2: rgb[k] = (((x / period) ^ (y / period)) & 1) ? a[k] : b[k];
+	  break ;
+	default: rgb[k] = (a[k] & 0xe0) + (bench_rand(seed) & 0x1f); break ;
+	}
       }
+      set_pixel(im, x, y, rgb);
+    }
+}
+
+static void bench_mkdir(const char* dirname)
+{
+#ifdef _WIN32
+  mkdir(dirname);
+#else
+  mkdir(dirname, 0755);
+#endif
+}
+
+static int bench_gen_lib(const char* dirname, unsigned int n)
+{
+  /* n images of 64 to 191 pixels per side */
+
+  char filename[INDEXER_PATH_MAX];
+  int len;
+  uint32_t seed = 0x2545f491;
+  unsigned int i;
+
+  bench_mkdir(dirname);
+
+  for (i = 0; i < n; ++i)
+  {
+    CvSize size;
+    IplImage* im;
+    int err;
+
+    size.width = 64 + bench_rand(&seed) % 128;
+    size.height = 64 + bench_rand(&seed) % 128;
+    im = cvCreateImage(size, IPL_DEPTH_8U, 3);
+    bench_fill(im, &seed);
+
+    len = snprintf(filename, sizeof(filename), "%s/b%07u.ppm", dirname, i);
+    err = (len < 0) || ((size_t)len >= sizeof(filename));
+    if (err == 0) err = (cvSaveImage(filename, im, NULL) == 0);
+    cvReleaseImage(&im);
+
+    if (err)
+    {
+      printf("cannot write %s\n", filename);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int bench_gen_target(const char* filename, int w, int h)
+{
+  /* smooth gradients with a coarse checker and some noise */
+
+  uint32_t seed = 0x9e3779b9;
+  unsigned char rgb[3];
+  CvSize size;
+  IplImage* im;
+  int err;
+  int x;
+  int y;
+
+  size.width = w;
+  size.height = h;
+  im = cvCreateImage(size, IPL_DEPTH_8U, 3);
+
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+    {
+      const unsigned int c = (((x / 97) ^ (y / 71)) & 1) * 64;
+      rgb[0] = (x * 255) / w;
+      rgb[1] = (y * 255) / h;
+      rgb[2] = c + (bench_rand(&seed) & 0x3f);
+      set_pixel(im, x, y, rgb);
+    }
 
-      /* right arrow */
-    case 0x53:
-      {
-	struct tile_node* tn;
+  err = (cvSaveImage(filename, im, NULL) == 0);
+  cvReleaseImage(&im);
 
-	/* select next tile in history */
+  if (err)
+  {
+    printf("cannot write %s\n", filename);
+    return -1;
+  }
 
-	for (tn = ei.sel_tiles; tn; tn = tn->next)
-	{
-	  i = tn->y * mi->w + tn->x;
-	  if (ei.hist_pos[i]->next) ei.hist_pos[i] = ei.hist_pos[i]->next;
-	  mi->tile_arr[i] = ei.hist_pos[i]->ie;
-	}
+  return 0;
+}
 
-	is_update = 1;
+static void bench_synth
+(struct index_info* ii, const struct index_info* lib, unsigned int n)
+{
+  /* in memory index of n descriptors, no records nor tiles. */
+  /* they are library ones plus noise, so that they cluster */
+  /* like the descriptors of real photos do */
 
-	break ;
-      }
+  uint32_t seed = 0x6a09e667;
+  unsigned int i;
+  unsigned int k;
 
-      /* replace select tiles by last selected one */
-    case 'r':
-      {
-	struct tile_node* tn;
-	struct index_entry* ie;
+  memset(ii, 0, sizeof(struct index_info));
+  ii->n = n;
+  ii->desc = calloc(n, DESC_STRIDE);
 
-	if (ei.sel_tiles == NULL) break ;
+  for (i = 0; i < n; ++i)
+  {
+    const unsigned char* const src =
+      index_desc(lib, bench_rand(&seed) % lib->n);
+    unsigned char* const dst = ii->desc + i * DESC_STRIDE;
 
-	ie = mi->tile_arr[ei.sel_tiles->y * mi->w + ei.sel_tiles->x];
+    for (k = 0; k < DESC_DIM; ++k)
+    {
+      const int v = (int)src[k] + (int)(bench_rand(&seed) % 33) - 16;
+      dst[k] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+    }
+  }
+}
 
-	for (tn = ei.sel_tiles; tn; tn = tn->next)
-	{
-	  i = tn->y * mi->w + tn->x;
-	  mi->tile_arr[i] = ie;
-	}
+static void bench_synth_free(struct index_info* ii)
+{
+  if (ii->tree != NULL) index_tree_free(ii->tree);
+  if (ii->pq != NULL) index_pq_free(ii->pq);
+  free(ii->desc);
+}
 
-	is_update = 1;
+static int cmp_u64(const void* a, const void* b)
+{
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
 
-	break ;
-      }
+static void bench_print
+(
+ FILE* file,
+ const char* name,
+ unsigned int nitem,
+ uint64_t nsec,
+ uint64_t* lat,
+ unsigned int nlat
+)
+{
+  /* one stage object. nitem items in nsec, lat the nlat latencies */
+  /* of the repeated operation, if any. lat is sorted in place */
 
-    case 'w':
-      {
-	ei.line_buf[ei.line_pos] = 0;
-	ei.line_pos = 0;
-	sscanf(ei.line_buf, "%u %u %u", &dist_w[0], &dist_w[1], &dist_w[2]);
-	printf("dist_w: %u %u %u\n", dist_w[0], dist_w[1], dist_w[2]);
-	break ;
-      }
+  const double sec = (double)nsec / 1e9;
 
-      /* escape, done with edition */
-    case 27:
-      {
-	is_done = 1;
-	break ;
-      }
+  fprintf(file, "    { \"name\": \"%s\", \"count\": %u, \"seconds\": %.6f",
+	  name, nitem, sec);
+  fprintf(file, ", \"per_second\": %.1f", sec > 0 ? nitem / sec : 0.0);
 
-    default:
-      {
-	const char c = k & 0xff;
-	if ((c == ' ') || ((c >= '0') && (c <= '9')))
-	  ei.line_buf[ei.line_pos++ % (sizeof(ei.line_buf) - 1)] = c;
-	else
-	  printf("unknown keycode: %x\n", k);
-	break ;
-      }
-    }
+  if (nlat)
+  {
+    qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+    fprintf(file, ", \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f",
+	    lat[nlat / 2] / 1e3, lat[(nlat * 9) / 10] / 1e3,
+	    lat[(nlat * 99) / 100] / 1e3);
+    fprintf(file, ", \"max_us\": %.2f", lat[nlat - 1] / 1e3);
+  }
 
-    if (is_update)
-    {
-      do_make_sel(ei.ii, ei.mi, ei.sel_tiles);
-      redraw_ed(&ei);
-    }
+  fprintf(file, " }");
+}
+
+static void bench_find
+(
+ FILE* file,
+ const char* name,
+ struct index_info* ii,
+ const unsigned char* queries,
+ unsigned int nquery,
+ unsigned int k
+)
+{
+  /* index_find, or index_find_knn when k is not 0, per query */
+
+  uint64_t* const lat = malloc(nquery * sizeof(uint64_t));
+  struct pick_info pi;
+  struct knn_info ki;
+  uint64_t total = 0;
+  unsigned int i;
+
+  ki.k = k;
+  ki.id = malloc((k ? k : 1) * sizeof(unsigned int));
+  ki.dist = malloc((k ? k : 1) * sizeof(unsigned int));
+
+  pick_init(&pi, ii, CONFIG_NTIL);
+
+  for (i = 0; i < nquery; ++i)
+  {
+    const unsigned char* const desc = queries + i * DESC_STRIDE;
+    const uint64_t t = get_nsec();
+
+    if (k) index_find_knn(ii, desc, &ki);
+    else index_find(ii, &pi, NULL, desc);
+
+    lat[i] = get_nsec() - t;
+    total += lat[i];
   }
 
-  /* release hist related arrays */
-  for (i = 0; i < (mi->w * mi->h); ++i)
+  fprintf(file, ",\n");
+  bench_print(file, name, nquery, total, lat, nquery);
+
+  pick_fini(&pi);
+  free(ki.id);
+  free(ki.dist);
+  free(lat);
+}
+
+static void bench_recall
+(
+ FILE* file,
+ const char* name,
+ struct index_info* ii,
+ const unsigned char* queries,
+ unsigned int nquery,
+ unsigned int k
+)
+{
+  /* fraction of the exact k nearest found by the quantized search */
+
+  struct index_pq* const pq = ii->pq;
+  struct knn_info ka;
+  struct knn_info kb;
+  uint64_t nfound = 0;
+  uint64_t nexact = 0;
+  unsigned int i;
+  unsigned int a;
+  unsigned int b;
+
+  ka.k = k;
+  ka.id = malloc(k * sizeof(unsigned int));
+  ka.dist = malloc(k * sizeof(unsigned int));
+  kb.k = k;
+  kb.id = malloc(k * sizeof(unsigned int));
+  kb.dist = malloc(k * sizeof(unsigned int));
+
+  for (i = 0; i < nquery; ++i)
   {
-    struct hist_node* hn = ei.hist_arr[i];
-    while (hn)
-    {
-      struct hist_node* const tmp = hn;
-      hn = hn->next;
-      free(tmp);
-    }
+    const unsigned char* const desc = queries + i * DESC_STRIDE;
+
+    ii->pq = NULL;
+    index_find_knn(ii, desc, &ka);
+    ii->pq = pq;
+    index_find_knn(ii, desc, &kb);
+
+    nexact += ka.n;
+    for (a = 0; a < ka.n; ++a)
+      for (b = 0; b < kb.n; ++b)
+	if (ka.id[a] == kb.id[b]) ++nfound;
   }
-  free(ei.hist_arr);
-  free(ei.hist_pos);
 
-  cvReleaseImage(&ei.ed_im);
+  fprintf(file, ",\n    { \"name\": \"%s\", \"count\": %u, \"k\": %u",
+	  name, nquery, k);
+  fprintf(file, ", \"recall\": %.4f }",
+	  nexact ? (double)nfound / (double)nexact : 0.0);
+
+  free(ka.id);
+  free(ka.dist);
+  free(kb.id);
+  free(kb.dist);
 }
 
+static void bench_queries
+(const struct index_info* ii, unsigned char* queries, unsigned int n)
+{
+  /* descriptors near random entries, some far from all */
+
+  uint32_t seed = 0xbb67ae85;
+  unsigned int i;
+  unsigned int k;
+
+  memset(queries, 0, n * DESC_STRIDE);
+
+  for (i = 0; i < n; ++i)
+  {
+    const unsigned char* const src =
+      index_desc(ii, bench_rand(&seed) % ii->n);
+    unsigned char* const dst = queries + i * DESC_STRIDE;
+    const unsigned int is_far = (i % 8) == 0;
+
+    for (k = 0; k < DESC_DIM; ++k)
+    {
+      if (is_far) dst[k] = bench_rand(&seed);
+      else dst[k] = src[k] ^ (bench_rand(&seed) & 0x0f);
+    }
+  }
+}
 
-static void do_make(struct index_info* ii, struct mozaic_info* mi)
+static int do_bench
+(
+ const char* dirname,
+ unsigned int nlib,
+ unsigned int ndesc,
+ unsigned int nthread
+)
 {
-  CvSize tile_size;
-  CvRect tile_roi;
-  CvSize shap_size;
-  int x;
-  int y;
+  /* generate, then time index, load, search, tile, make and edit */
+  /* ndesc, if not 0, is the size of an in memory index also */
+  /* searched, to measure large libraries without their images */
+
+  struct index_info ii;
+  struct mozaic_info mi;
+  struct ed_info ei;
+  char libname[INDEXER_PATH_MAX];
+  char target[INDEXER_PATH_MAX];
+  char filename[INDEXER_PATH_MAX];
+  unsigned char* queries;
+  uint64_t* lat;
+  uint64_t total;
+  uint64_t t;
+  uint32_t seed = 0x3c6ef372;
+  FILE* file;
+  unsigned int ncand;
+  unsigned int i;
 
-  /* pixels per tile */
-  const int npix = CONFIG_NPIX;
+  printf("[ do_bench ] %u images in %s\n", nlib, dirname);
 
-  tile_size.width = mi->w * npix;
-  tile_size.height = mi->h * npix;
+  /* the longest path is the atlas do_index writes in the library */
+  if ((strlen(dirname) + sizeof("/lib/tilit_atlas.tmp")) > sizeof(filename))
+  {
+    printf("bench directory name too long\n");
+    return -1;
+  }
+
+  /* the library in dirname/lib, the rest next to it */
+  bench_mkdir(dirname);
+  snprintf(libname, sizeof(libname), "%s/lib", dirname);
+  if (bench_gen_lib(libname, nlib)) return -1;
+  snprintf(target, sizeof(target), "%s/target.ppm", dirname);
+  if (bench_gen_target(target, 1600, 1200)) return -1;
+
+  snprintf(filename, sizeof(filename), "%s/tilit_bench.json", dirname);
+  file = fopen(filename, "w");
+  if (file == NULL)
+  {
+    printf("cannot write %s\n", filename);
+    return -1;
+  }
 
-  if (mi->tile_im == NULL)
-    mi->tile_im = cvCreateImage(tile_size, IPL_DEPTH_8U, 3);
+  fprintf(file, "{\n  \"config\": { \"nlib\": %u, \"ndesc\": %u", nlib, ndesc);
+  fprintf(file, ", \"nthread\": %u, \"ntil\": %u, \"npix\": %u",
+	  get_nthread(nthread), CONFIG_NTIL, CONFIG_NPIX);
+  fprintf(file, ", \"desc_dim\": %u },\n  \"stages\": [\n", DESC_DIM);
 
-  shap_size.width = npix;
-  shap_size.height = npix;
+  /* indexing, from scratch then with nothing changed */
+  t = get_nsec();
+  do_index(libname, NULL, 0, nthread, 0);
+  bench_print(file, "index", nlib, get_nsec() - t, NULL, 0);
 
-  printf("[ do_make ]\n");
+  t = get_nsec();
+  do_index(libname, NULL, 0, nthread, 1);
+  fprintf(file, ",\n");
+  bench_print(file, "reindex", nlib, get_nsec() - t, NULL, 0);
 
-  for (y = 0; y < mi->h; ++y)
+  t = get_nsec();
+  if (index_load(&ii, libname))
   {
-    printf("y == %d / %d\n", y, mi->h); fflush(stdout);
+    fclose(file);
+    return -1;
+  }
+  fprintf(file, ",\n");
+  bench_print(file, "index_load", ii.n, get_nsec() - t, NULL, 0);
 
-    for (x = 0; x < mi->w; ++x)
-    {
-      struct index_entry* const ie = mi->tile_arr[y * mi->w + x];
+  /* searches, as the tiler and the editor do them */
+  queries = malloc(BENCH_NQUERY * DESC_STRIDE);
+  bench_queries(&ii, queries, BENCH_NQUERY);
+  ncand = INDEX_PENALTY(CONFIG_NTIL);
+  if (ncand > ii.n) ncand = ii.n;
 
-      if (ie->cached_im == NULL)
-      {
-	char near_filename[128];
-	IplImage* im_near;
-
-	/* reshape nearest image */
-	sprintf(near_filename, "%s/%s", ii->dirname, ie->filename);
-	im_near = do_open(near_filename);
-	ie->cached_im = cvCreateImage(shap_size, IPL_DEPTH_8U, 3);
-	do_reshape(im_near, ie->cached_im);
-	cvReleaseImage(&im_near);
-      }
+  bench_find(file, "find_scan", &ii, queries, BENCH_NQUERY, 0);
 
-      /* blit in tile image */
-      tile_roi.x = x * npix;
-      tile_roi.y = y * npix;
-      tile_roi.width = npix;
-      tile_roi.height = npix;
+  t = get_nsec();
+  ii.tree = index_tree_create(&ii);
+  fprintf(file, ",\n");
+  bench_print(file, "tree_create", ii.n, get_nsec() - t, NULL, 0);
+
+  bench_find(file, "find_tree", &ii, queries, BENCH_NQUERY, 0);
+  bench_find(file, "knn_tree", &ii, queries, BENCH_NQUERY, ncand);
+
+  /* tile and make, whole runs */
+  lat = malloc(BENCH_NRUN * sizeof(uint64_t));
+  mi.tile_im = NULL;
+  mi.npix = CONFIG_NPIX;
+
+  total = 0;
+  for (i = 0; i < BENCH_NRUN; ++i)
+  {
+    if (i)
+    {
+      free(mi.tile_arr);
+      free(mi.desc);
+    }
 
-      cvSetImageROI(mi->tile_im, tile_roi);
-      cvCopy(ie->cached_im, mi->tile_im, NULL);
+    t = get_nsec();
+    if (do_tile(target, &ii, &mi, CONFIG_NTIL, nthread))
+    {
+      fclose(file);
+      return -1;
     }
+    lat[i] = get_nsec() - t;
+    total += lat[i];
   }
+  fprintf(file, ",\n");
+  bench_print(file, "tile", BENCH_NRUN * mi.w * mi.h, total, lat, BENCH_NRUN);
 
-  cvResetImageROI(mi->tile_im);
-}
+  total = 0;
+  for (i = 0; i < BENCH_NRUN; ++i)
+  {
+    t = get_nsec();
+    do_make(&ii, &mi, nthread);
+    lat[i] = get_nsec() - t;
+    total += lat[i];
+  }
+  fprintf(file, ",\n");
+  bench_print(file, "make", BENCH_NRUN * mi.w * mi.h, total, lat, BENCH_NRUN);
 
+  free(lat);
 
-static void do_save_mozaic(struct mozaic_info* mi, const char* filename)
-{
-  const int wh = mi->w * mi->h;
-  char line_buf[256];
-  int line_len;
-  int fd;
-  int i;
+  /* editor, alternatives of random rectangles then history back */
+  ed_init(&ei, &ii, &mi, NULL);
+  lat = malloc(2 * BENCH_NEDIT * sizeof(uint64_t));
+
+  for (i = 0; i < BENCH_NEDIT; ++i)
+  {
+    const int x = bench_rand(&seed) % mi.w;
+    const int y = bench_rand(&seed) % mi.h;
+    const int d = bench_rand(&seed) % 4;
+
+    select_ed_rect(&ei, x, y, x + d, y + d, 1);
+    compose_ed(&ei);
+
+    t = get_nsec();
+    ed_prev(&ei);
+    compose_ed(&ei);
+    lat[i] = get_nsec() - t;
+
+    t = get_nsec();
+    ed_next(&ei);
+    compose_ed(&ei);
+    lat[BENCH_NEDIT + i] = get_nsec() - t;
+
+    select_ed_rect(&ei, x, y, x + d, y + d, 0);
+    compose_ed(&ei);
+  }
+
+  for (total = 0, i = 0; i < BENCH_NEDIT; ++i) total += lat[i];
+  fprintf(file, ",\n");
+  bench_print(file, "edit_prev", BENCH_NEDIT, total, lat, BENCH_NEDIT);
+  for (total = 0, i = 0; i < BENCH_NEDIT; ++i) total += lat[BENCH_NEDIT + i];
+  fprintf(file, ",\n");
+  bench_print
+    (file, "edit_next", BENCH_NEDIT, total, lat + BENCH_NEDIT, BENCH_NEDIT);
 
-  fd = open(filename, O_RDWR | O_TRUNC | O_CREAT, 0700);
+  free(lat);
+  ed_fini(&ei);
 
-  line_len = sprintf(line_buf, "%d %d\n", mi->w, mi->h);
-  write(fd, line_buf, line_len);
+  cvReleaseImage(&mi.tile_im);
+  free(mi.tile_arr);
+  free(mi.desc);
 
-  line_len = sprintf(line_buf, "%d\n", CONFIG_NPIX);
-  write(fd, line_buf, line_len);
+  /* quantized codes, the in memory descriptors are released */
+  t = get_nsec();
+  ii.pq = index_pq_create(&ii, nthread);
+  fprintf(file, ",\n");
+  bench_print(file, "pq_create", ii.n, get_nsec() - t, NULL, 0);
 
-  for (i = 0; i < wh; ++i)
+  bench_find(file, "knn_pq", &ii, queries, BENCH_NQUERY, ncand);
+  bench_recall(file, "recall_pq", &ii, queries, BENCH_NQUERY, ncand);
+
+  /* large in memory index */
+  if (ndesc)
   {
-    const struct index_entry* const ie = mi->tile_arr[i];
-    line_len = sprintf(line_buf, "%s\n", ie->filename);
-    write(fd, line_buf, line_len);
+    struct index_info si;
+
+    bench_synth(&si, &ii, ndesc);
+    bench_queries(&si, queries, BENCH_NQUERY);
+
+    bench_find(file, "synth_find_scan", &si, queries, BENCH_NQUERY / 10, 0);
+
+    t = get_nsec();
+    si.tree = index_tree_create(&si);
+    fprintf(file, ",\n");
+    bench_print(file, "synth_tree_create", si.n, get_nsec() - t, NULL, 0);
+
+    bench_find(file, "synth_find_tree", &si, queries, BENCH_NQUERY, 0);
+    bench_find(file, "synth_knn_tree", &si, queries, BENCH_NQUERY, ncand);
+
+    t = get_nsec();
+    si.pq = index_pq_create(&si, nthread);
+    fprintf(file, ",\n");
+    bench_print(file, "synth_pq_create", si.n, get_nsec() - t, NULL, 0);
+
+    bench_find(file, "synth_knn_pq", &si, queries, BENCH_NQUERY, ncand);
+    bench_recall
+      (file, "synth_recall_pq", &si, queries, BENCH_NQUERY / 10, ncand);
+
+    bench_synth_free(&si);
   }
 
-  close(fd);
+  fprintf(file, "\n  ],\n  \"stats\": ");
+  stats_print(file, 1);
+  fprintf(file, "}\n");
+  fclose(file);
+
+  free(queries);
+  if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+  index_free(&ii);
+
+  printf("results in %s/tilit_bench.json\n", dirname);
+
+  return 0;
 }
 
 
 int main(int ac, char** av)
 {
-  if (strcmp(av[1], "index") == 0)
+  if (CONFIG_STATS) atexit(stats_exit);
+
+  if ((strcmp(av[1], "index") == 0) || (strcmp(av[1], "reindex") == 0))
   {
-    do_index("../pic/india/trekearth.new/trekearth");
+    /* optional worker thread count, index directory and other */
+    /* roots merged into it. reindex only computes new or modified */
+    /* files */
+    const unsigned int nthread = (ac > 2) ? atoi(av[2]) : 0;
+    const char* const dirname = (ac > 3) ?
+      av[3] : "../pic/india/trekearth.new/trekearth";
+    const unsigned int nroot = (ac > 4) ? ac - 4 : 0;
+
+    do_index
+      (dirname, (const char* const*)av + 4, nroot, nthread,
+       strcmp(av[1], "reindex") == 0);
+  }
+  else if (strcmp(av[1], "convert") == 0)
+  {
+    /* text index to binary */
+    do_convert("../pic/india/trekearth.new/trekearth");
   }
   else if (strcmp(av[1], "tile") == 0)
   {
     struct mozaic_info mi;
     struct index_info ii;
+    unsigned int nthread = 0;
 
     mi.tile_im = NULL;
+    mi.npix = CONFIG_NPIX;
 
-    index_load(&ii, "../pic/india/trekearth.new/trekearth");
+    if (index_load(&ii, "../pic/india/trekearth.new/trekearth")) return -1;
     /* index_load(&ii, "../pic/kiosked"); */
 
+    /* optional matching thread count */
+    if (ac > 3) nthread = atoi(av[3]);
+
+    /* nearest neighbor search engine, tree unless scan or pq is given */
+    if ((ac > 2) && (strcmp(av[2], "pq") == 0))
+      ii.pq = index_pq_create(&ii, nthread);
+    else if ((ac <= 2) || strcmp(av[2], "scan"))
+      ii.tree = index_tree_create(&ii);
+
     /* do_tile("../pic/roland_15/main.jpg", &ii, &mi); */
-    do_tile("../pic/roland_14/main_gimped.jpg", &ii, &mi);
+    if (do_tile
+	("../pic/roland_14/main_gimped.jpg", &ii, &mi, CONFIG_NTIL, nthread))
+      return -1;
     /* do_tile("../pic/face_1/main.jpg", &ii, &mi); */
-    do_make(&ii, &mi);
-    do_edit(&ii, &mi);
+    do_make(&ii, &mi, nthread);
+    do_edit(&ii, &mi, NULL, "/tmp/mozaic.til");
+
+    cvSaveImage("/tmp/tile.jpg", mi.tile_im, NULL);
+
+    cvReleaseImage(&mi.tile_im);
+    free(mi.desc);
+
+    free(mi.tile_arr);
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+    index_free(&ii);
+  }
+  else if (strcmp(av[1], "resume") == 0)
+  {
+    /* edit a saved session again, with its history */
+    struct mozaic_info mi;
+    struct index_info ii;
+    struct session_hist sh;
+    const char* const filename = (ac > 2) ? av[2] : "/tmp/mozaic.til";
+
+    if (index_load(&ii, "../pic/india/trekearth.new/trekearth")) return -1;
+    ii.tree = index_tree_create(&ii);
+
+    if (session_load(&ii, &mi, &sh, filename))
+    {
+      index_free(&ii);
+      return -1;
+    }
+
+    /* rendered by do_edit */
+    do_edit(&ii, &mi, &sh, filename);
 
     cvSaveImage("/tmp/tile.jpg", mi.tile_im, NULL);
-    do_save_mozaic(&mi, "/tmp/mozaic.til");
 
+    session_hist_free(&sh);
     cvReleaseImage(&mi.tile_im);
-    cvReleaseImage(&mi.ycc_im);
+    free(mi.desc);
+    free(mi.tile_arr);
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+    index_free(&ii);
+  }
+  else if (strcmp(av[1], "rerender") == 0)
+  {
+    /* render a saved session, optionally at another tile size, */
+    /* without matching */
+    struct mozaic_info mi;
+    struct index_info ii;
+    const int npix = (ac > 4) ? atoi(av[4]) : 0;
+    const unsigned int nthread = (ac > 5) ? atoi(av[5]) : 0;
+    int err;
+
+    if (ac <= 3)
+    {
+      printf("missing session or output filename\n");
+      return -1;
+    }
+
+    if (index_load(&ii, "../pic/india/trekearth.new/trekearth")) return -1;
+
+    if (session_load(&ii, &mi, NULL, av[2]))
+    {
+      index_free(&ii);
+      return -1;
+    }
+
+    if (npix > 0) mi.npix = npix;
+    err = do_make_strips(&ii, &mi, av[3], nthread);
+
+    free(mi.desc);
+    free(mi.tile_arr);
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+    index_free(&ii);
+
+    if (err) return -1;
+  }
+  else if (strcmp(av[1], "sweep") == 0)
+  {
+    /* match quality of a range of tile counts */
+    struct index_info ii;
+    const int ntil_lo = (ac > 2) ? atoi(av[2]) : CONFIG_NTIL / 2;
+    const int ntil_hi = (ac > 3) ? atoi(av[3]) : CONFIG_NTIL * 2;
+    const unsigned int nthread = (ac > 4) ? atoi(av[4]) : 0;
+
+    if ((ntil_lo < 1) || (ntil_lo > ntil_hi))
+    {
+      printf("invalid tile counts %d to %d\n", ntil_lo, ntil_hi);
+      return -1;
+    }
+
+    if (index_load(&ii, "../pic/india/trekearth.new/trekearth")) return -1;
+    ii.tree = index_tree_create(&ii);
+
+    do_sweep
+      ("../pic/roland_14/main_gimped.jpg", &ii, ntil_lo, ntil_hi, nthread);
+
+    index_free(&ii);
+  }
+  else if (strcmp(av[1], "batch") == 0)
+  {
+    /* headless jobs from a list, sharing one loaded index */
+    struct index_info ii;
+    const char* const dirname = (ac > 3) ?
+      av[3] : "../pic/india/trekearth.new/trekearth";
+    const unsigned int nthread = (ac > 4) ? atoi(av[4]) : 0;
+    int err;
+
+    if (ac <= 2)
+    {
+      printf("missing job list\n");
+      return -1;
+    }
+
+    if (index_load(&ii, dirname)) return -1;
+    ii.tree = index_tree_create(&ii);
+
+    err = do_batch(&ii, av[2], nthread);
 
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+    index_free(&ii);
+
+    if (err) return -1;
+  }
+#ifndef _WIN32
+  else if (strcmp(av[1], "serve") == 0)
+  {
+    /* resident, jobs over a unix socket */
+    struct index_info ii;
+    const char* const dirname = (ac > 3) ?
+      av[3] : "../pic/india/trekearth.new/trekearth";
+    const unsigned int nthread = (ac > 4) ? atoi(av[4]) : 0;
+    int err;
+
+    if (ac <= 2)
+    {
+      printf("missing socket path\n");
+      return -1;
+    }
+
+    if (index_load(&ii, dirname)) return -1;
+    ii.tree = index_tree_create(&ii);
+
+    err = do_serve(&ii, av[2], nthread);
+
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
+    index_free(&ii);
+
+    if (err) return -1;
+  }
+#endif /* _WIN32 */
+  else if (strcmp(av[1], "bench") == 0)
+  {
+    /* synthetic library and target, timings as json */
+    const char* const dirname = (ac > 2) ? av[2] : "/tmp/tilit_bench";
+    const unsigned int nlib = (ac > 3) ? atoi(av[3]) : 1000;
+    const unsigned int ndesc = (ac > 4) ? atoi(av[4]) : 0;
+    const unsigned int nthread = (ac > 5) ? atoi(av[5]) : 0;
+
+    if (nlib == 0)
+    {
+      printf("empty library\n");
+      return -1;
+    }
+
+    if (do_bench(dirname, nlib, ndesc, nthread)) return -1;
+  }
+  else if (strcmp(av[1], "render") == 0)
+  {
+    /* headless, render to a .tif or .ppm file one strip at a time */
+    struct mozaic_info mi;
+    struct index_info ii;
+    const unsigned int nthread = (ac > 3) ? atoi(av[3]) : 0;
+    int err;
+
+    if (ac <= 2)
+    {
+      printf("missing output filename\n");
+      return -1;
+    }
+
+    mi.tile_im = NULL;
+    mi.npix = CONFIG_NPIX;
+
+    if (index_load(&ii, "../pic/india/trekearth.new/trekearth")) return -1;
+    ii.tree = index_tree_create(&ii);
+
+    if (do_tile
+	("../pic/roland_14/main_gimped.jpg", &ii, &mi, CONFIG_NTIL, nthread))
+      return -1;
+    err = do_make_strips(&ii, &mi, av[2], nthread);
+    session_save(&ii, &mi, NULL, "/tmp/mozaic.til");
+
+    free(mi.desc);
     free(mi.tile_arr);
+    if (ii.has_atlas == 0) tile_cache_print(&ii.tiles);
     index_free(&ii);
+
+    if (err) return -1;
   }
 
   return 0;